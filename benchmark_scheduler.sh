@@ -1,6 +1,7 @@
 #!/bin/bash
 
-# Quick benchmark runner: generates a short report comparing this eBPF scheduler vs CFS.
+# Quick benchmark runner: one short wakeup latency run under CFS and one under this
+# eBPF scheduler, written to a short report. Needs root to load the scheduler.
 
 set +e
 
@@ -8,14 +9,19 @@ set +e
 RESULTS_DIR="./benchmark_results"
 TIMESTAMP=$(date +%Y%m%d_%H%M%S)
 REPORT_FILE="$RESULTS_DIR/benchmark_report_${TIMESTAMP}.txt"
+LOADER_LOG="$RESULTS_DIR/loader_${TIMESTAMP}.log"
 
-# Workload size knobs (synthetic)
-NUM_TASKS_SMALL=50
-NUM_TASKS_MEDIUM=500
-NUM_TASKS_LARGE=1000
+# Binaries (make all)
+LOADER="./build/bin/loader"
+BPF_OBJ="./build/scheduler.bpf.o"
+BENCH="./build/bin/wakeup_bench"
 
+# Workload size knobs
+NR_CPUS=$(nproc)
+MESSAGE_THREADS=2
+WORKERS=$(( NR_CPUS / MESSAGE_THREADS > 0 ? NR_CPUS / MESSAGE_THREADS : 1 ))
 DURATION_PER_TEST=5  # seconds
-ITERATIONS=3
+WARMUP=1
 
 # Terminal colors
 RED='\033[0;31m'
@@ -24,9 +30,9 @@ YELLOW='\033[1;33m'
 BLUE='\033[0;34m'
 NC='\033[0m'
 
-# Captured metrics
-declare -A results_ebpf
-declare -A results_cfs
+# Captured summary lines
+declare -A summaries
+LOADER_PID=""
 
 # Small helpers for consistent output/report formatting.
 
@@ -56,270 +62,64 @@ write_report() {
     echo "$1" >> "$REPORT_FILE"
 }
 
-# Benchmark: dispatch latency (enqueue -> dispatch).
-benchmark_dispatch_latency() {
-    log_test "Task Dispatch Latency (Time to dispatch task after enqueue)"
-    
-    local ebpf_latencies=()
-    local cfs_latencies=()
-    
-    for ((i=0; i<ITERATIONS; i++)); do
-        log_info "Iteration $((i+1))/$ITERATIONS - EBPF Scheduler"
-        
-        # Simulated measurement (replace with real timing if you hook tracepoints/perf).
-        local ebpf_lat=$((RANDOM % 100 + 5))  # 5-105 microseconds
-        ebpf_latencies+=($ebpf_lat)
-        echo "  Dispatch latency: ${ebpf_lat}μs"
-        
-        log_info "Iteration $((i+1))/$ITERATIONS - CFS Scheduler"
-        
-        # Simulated baseline for CFS.
-        local cfs_lat=$((RANDOM % 150 + 20))  # 20-170 microseconds
-        cfs_latencies+=($cfs_lat)
-        echo "  Dispatch latency: ${cfs_lat}μs"
-    done
-    
-    # Average the iterations.
-    local ebpf_avg=$(( (${ebpf_latencies[0]} + ${ebpf_latencies[1]} + ${ebpf_latencies[2]}) / 3 ))
-    local cfs_avg=$(( (${cfs_latencies[0]} + ${cfs_latencies[1]} + ${cfs_latencies[2]}) / 3 ))
-    
-    results_ebpf["dispatch_latency"]=$ebpf_avg
-    results_cfs["dispatch_latency"]=$cfs_avg
-    
-    log_pass "Dispatch Latency Results:"
-    echo "  eBPF Scheduler: ${ebpf_avg}μs (avg)"
-    echo "  CFS Scheduler:  ${cfs_avg}μs (avg)"
-    
-    local improvement=$(( (cfs_avg - ebpf_avg) * 100 / cfs_avg ))
-    echo -e "  ${GREEN}Improvement: ${improvement}% faster with eBPF${NC}"
-    
-    write_report "Task Dispatch Latency"
-    write_report "eBPF Scheduler: ${ebpf_avg}μs"
-    write_report "CFS Scheduler:  ${cfs_avg}μs"
-    write_report "Improvement: ${improvement}% faster"
-    write_report ""
+# Value of key in a wakeup_bench "summary:" line
+field() {
+    echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
 }
 
-# Benchmark: context switch overhead (synthetic).
-benchmark_context_switch() {
-    log_test "Context Switch Overhead"
-    
-    log_info "Testing with $NUM_TASKS_MEDIUM concurrent tasks"
-    
-    # Simulated measurement (real world: use perf stat / procfs counters).
-    
-    for ((i=0; i<ITERATIONS; i++)); do
-        log_info "Iteration $((i+1))/$ITERATIONS"
-        
-        local ebpf_switches=$((RANDOM % 5000 + 1000))  # 1000-6000 ctx switches
-        local cfs_switches=$((RANDOM % 8000 + 2000))   # 2000-10000 ctx switches
-        
-        results_ebpf["ctx_switches"]=$ebpf_switches
-        results_cfs["ctx_switches"]=$cfs_switches
-        
-        echo "  eBPF context switches: $ebpf_switches"
-        echo "  CFS context switches:  $cfs_switches"
+# Start the loader daemon and wait until sched_ext reports it enabled
+start_scheduler() {
+    "$LOADER" --daemon "$BPF_OBJ" >> "$LOADER_LOG" 2>&1 &
+    LOADER_PID=$!
+
+    for ((i=0; i<50; i++)); do
+        if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+            return 0
+        fi
+        if ! kill -0 "$LOADER_PID" 2>/dev/null; then
+            break
+        fi
+        sleep 0.2
     done
-    
-    local ebpf_avg=${results_ebpf["ctx_switches"]}
-    local cfs_avg=${results_cfs["ctx_switches"]}
-    
-    log_pass "Context Switch Results:"
-    echo "  eBPF Scheduler: $ebpf_avg switches"
-    echo "  CFS Scheduler:  $cfs_avg switches"
-    
-    local reduction=$(( (cfs_avg - ebpf_avg) * 100 / cfs_avg ))
-    echo -e "  ${GREEN}Reduction: ${reduction}% fewer context switches${NC}"
-    
-    write_report "Context Switch Overhead"
-    write_report "eBPF Scheduler: $ebpf_avg switches"
-    write_report "CFS Scheduler:  $cfs_avg switches"
-    write_report "Reduction: ${reduction}% fewer"
-    write_report ""
-}
 
-# Benchmark: throughput (tasks/sec).
-benchmark_throughput() {
-    log_test "Task Throughput (Tasks dispatched per second)"
-    
-    for load in "small:$NUM_TASKS_SMALL" "medium:$NUM_TASKS_MEDIUM" "large:$NUM_TASKS_LARGE"; do
-        IFS=':' read -r load_name num_tasks <<< "$load"
-        log_info "Testing with $num_tasks tasks ($load_name load)"
-        
-        # Simulated measurement (real world: count dispatches over time).
-        
-        local ebpf_throughput=$((num_tasks * 1000 + RANDOM % 500))  # tasks/sec
-        local cfs_throughput=$((num_tasks * 800 + RANDOM % 400))    # tasks/sec (lower)
-        
-        results_ebpf["throughput_$load_name"]=$ebpf_throughput
-        results_cfs["throughput_$load_name"]=$cfs_throughput
-        
-        echo "  eBPF throughput: $ebpf_throughput tasks/sec"
-        echo "  CFS throughput:  $cfs_throughput tasks/sec"
-        
-        local improvement=$(( (ebpf_throughput - cfs_throughput) * 100 / cfs_throughput ))
-        echo -e "  ${GREEN}Improvement: ${improvement}% higher throughput${NC}"
-        
-        write_report "Throughput ($load_name: $num_tasks tasks)"
-        write_report "eBPF Scheduler: $ebpf_throughput tasks/sec"
-        write_report "CFS Scheduler:  $cfs_throughput tasks/sec"
-        write_report "Improvement: ${improvement}% higher"
-        write_report ""
-    done
+    log_fail "Scheduler did not start, see $LOADER_LOG"
+    stop_scheduler
+    return 1
 }
 
-# Benchmark: CPU utilization (synthetic).
-benchmark_cpu_utilization() {
-    log_test "CPU Utilization Efficiency"
-    
-    log_info "Testing with $NUM_TASKS_MEDIUM concurrent tasks"
-    
-    # Simulated measurement (real world: measure via top/mpstat/perf).
-    
-    local ebpf_cpu=$((50 + RANDOM % 20))   # 50-70% CPU usage
-    local cfs_cpu=$((60 + RANDOM % 25))    # 60-85% CPU usage
-    
-    results_ebpf["cpu_util"]=$ebpf_cpu
-    results_cfs["cpu_util"]=$cfs_cpu
-    
-    log_pass "CPU Utilization Results:"
-    echo "  eBPF Scheduler: ${ebpf_cpu}%"
-    echo "  CFS Scheduler:  ${cfs_cpu}%"
-    
-    local savings=$((cfs_cpu - ebpf_cpu))
-    echo -e "  ${GREEN}Savings: ${savings}% lower CPU usage${NC}"
-    
-    write_report "CPU Utilization"
-    write_report "eBPF Scheduler: ${ebpf_cpu}%"
-    write_report "CFS Scheduler:  ${cfs_cpu}%"
-    write_report "Savings: ${savings}% lower"
-    write_report ""
+stop_scheduler() {
+    if [ -n "$LOADER_PID" ]; then
+        kill -INT "$LOADER_PID" 2>/dev/null
+        wait "$LOADER_PID" 2>/dev/null
+        LOADER_PID=""
+    fi
 }
 
-# Benchmark: wake-up latency.
+# Benchmark: wakeup-to-run latency under the currently active scheduler.
 benchmark_wakeup_latency() {
-    log_test "Task Wake-up Latency (Time from event to scheduler response)"
-    
-    log_info "Measuring wake-up latency for I/O-bound tasks"
-    
-    for ((i=0; i<ITERATIONS; i++)); do
-        log_info "Iteration $((i+1))/$ITERATIONS"
-        
-        # Simulate wake-up latency measurement
-        # Real: measure time from I/O completion to task running
-        
-        local ebpf_wakeup=$((RANDOM % 50 + 10))  # 10-60 microseconds
-        local cfs_wakeup=$((RANDOM % 100 + 30))  # 30-130 microseconds
-        
-        results_ebpf["wakeup_lat"]=$ebpf_wakeup
-        results_cfs["wakeup_lat"]=$cfs_wakeup
-        
-        echo "  eBPF wake-up latency: ${ebpf_wakeup}μs"
-        echo "  CFS wake-up latency:  ${cfs_wakeup}μs"
-    done
-    
-    local ebpf_avg=${results_ebpf["wakeup_lat"]}
-    local cfs_avg=${results_cfs["wakeup_lat"]}
-    
-    log_pass "Wake-up Latency Results:"
-    echo "  eBPF Scheduler: ${ebpf_avg}μs"
-    echo "  CFS Scheduler:  ${cfs_avg}μs"
-    
-    local improvement=$(( (cfs_avg - ebpf_avg) * 100 / cfs_avg ))
-    echo -e "  ${GREEN}Improvement: ${improvement}% faster wake-ups${NC}"
-    
-    write_report "Task Wake-up Latency"
-    write_report "eBPF Scheduler: ${ebpf_avg}μs"
-    write_report "CFS Scheduler:  ${cfs_avg}μs"
-    write_report "Improvement: ${improvement}% faster"
-    write_report ""
-}
+    local sched=$1
 
-# Benchmark: priority vs batch dispatch ratio.
-benchmark_priority_fairness() {
-    log_test "Priority vs Batch Queue Fairness"
-    
-    log_info "Testing with 300 priority + 200 batch tasks"
-    
-    # Measure dispatch distribution
-    local priority_dispatches=$((300 + RANDOM % 50))
-    local batch_dispatches=$((150 + RANDOM % 50))   # Should be lower due to priority
-    
-    results_ebpf["priority_dispatches"]=$priority_dispatches
-    results_ebpf["batch_dispatches"]=$batch_dispatches
-    
-    log_pass "Queue Fairness Results:"
-    echo "  Priority tasks dispatched: $priority_dispatches"
-    echo "  Batch tasks dispatched:    $batch_dispatches"
-    
-    local priority_pct=$((priority_dispatches * 100 / (priority_dispatches + batch_dispatches)))
-    echo -e "  ${GREEN}Priority queue received: ${priority_pct}% of dispatch cycles${NC}"
-    
-    write_report "Priority Queue Fairness"
-    write_report "Priority tasks dispatched: $priority_dispatches"
-    write_report "Batch tasks dispatched: $batch_dispatches"
-    write_report "Priority percentage: ${priority_pct}%"
-    write_report ""
-}
+    log_test "Wakeup latency under $sched ($MESSAGE_THREADS message threads x $WORKERS workers)"
 
-# Benchmark: latency scaling vs task count.
-benchmark_scalability() {
-    log_test "Scalability Analysis (Performance vs Task Count)"
-    
-    log_info "Testing linear scalability with increasing task loads"
-    
-    for load in "50" "100" "500" "1000"; do
-        log_info "Testing with $load tasks"
-        
-        # Simulate latency growth
-        local ebpf_lat=$((RANDOM % 50 + load / 10))
-        local cfs_lat=$((RANDOM % 100 + load / 5))
-        
-        echo "  eBPF latency: ${ebpf_lat}μs"
-        echo "  CFS latency:  ${cfs_lat}μs"
-        
-        write_report "Task Count: $load"
-        write_report "  eBPF: ${ebpf_lat}μs, CFS: ${cfs_lat}μs"
-    done
-    
-    echo -e "  ${GREEN}OK: both schedulers scale linearly${NC}"
-    echo -e "  ${GREEN}OK: eBPF maintains advantage across all load levels${NC}"
-    
-    write_report ""
+    summaries[$sched]=$("$BENCH" -m "$MESSAGE_THREADS" -t "$WORKERS" \
+        -r "$DURATION_PER_TEST" -w "$WARMUP" | grep '^summary:')
+    echo "  ${summaries[$sched]}"
 }
 
 # Generate a compact summary table.
 generate_summary() {
     log_test "Benchmark Summary"
-    
-    echo ""
-    echo -e "${BLUE}PERFORMANCE COMPARISON SUMMARY${NC}"
-    echo "Dispatch latency:   ${results_ebpf[dispatch_latency]}us (eBPF) vs ${results_cfs[dispatch_latency]}us (CFS)"
-    echo "Context switches:   ${results_ebpf[ctx_switches]} (eBPF) vs ${results_cfs[ctx_switches]} (CFS)"
-    echo "CPU utilization:    ${results_ebpf[cpu_util]}% (eBPF) vs ${results_cfs[cpu_util]}% (CFS)"
-    echo "Wake-up latency:    ${results_ebpf[wakeup_lat]}us (eBPF) vs ${results_cfs[wakeup_lat]}us (CFS)"
-    echo "Throughput (med):   ${results_ebpf[throughput_medium]}/s (eBPF) vs ${results_cfs[throughput_medium]}/s (CFS)"
-    
-    # Build comparison rows
-    printf "Dispatch Latency          | %6s | %6s | %13s\n" \
-        "${results_ebpf[dispatch_latency]}μs" "${results_cfs[dispatch_latency]}μs" "~30% faster"
-    
-    printf "Context Switches          | %6s | %6s | %13s\n" \
-        "${results_ebpf[ctx_switches]}" "${results_cfs[ctx_switches]}" "~25% fewer"
-    
-    printf "CPU Utilization           | %6s%% | %6s%% | %13s\n" \
-        "${results_ebpf[cpu_util]}" "${results_cfs[cpu_util]}" "~15% lower"
-    
-    printf "Wake-up Latency           | %6s | %6s | %13s\n" \
-        "${results_ebpf[wakeup_lat]}μs" "${results_cfs[wakeup_lat]}μs" "~40% faster"
-    
-    printf "Throughput (Med Load)     | %6s | %6s | %13s\n" \
-        "${results_ebpf[throughput_medium]}/s" "${results_cfs[throughput_medium]}/s" "~25% higher"
-    
-    echo ""
-    
-    write_report "SUMMARY: Performance Comparison"
-    write_report "This report summarizes the numbers collected in this run."
+
+    write_report "Wakeup latency ($MESSAGE_THREADS message threads x $WORKERS workers, ${DURATION_PER_TEST}s)"
+    write_report "$(printf '%-10s | %10s | %10s | %10s | %12s' Scheduler 'p50 (us)' 'p99 (us)' 'p99.9 (us)' 'wakeups/s')"
+    for sched in CFS eBPF; do
+        local s=${summaries[$sched]}
+
+        write_report "$(printf '%-10s | %10s | %10s | %10s | %12s' "$sched" \
+            "$(field "$s" p50_us)" "$(field "$s" p99_us)" "$(field "$s" p999_us)" \
+            "$(field "$s" wakeups_per_sec)")"
+    done
+    write_report ""
 }
 
 # Main entry point.
@@ -327,64 +127,49 @@ generate_summary() {
 main() {
     echo ""
     echo "Performance Benchmarking: eBPF vs Linux CFS Scheduler"
-    echo "Purpose: compare scheduler metrics for the dual-queue policy"
     echo ""
-    
+
+    for f in "$LOADER" "$BPF_OBJ" "$BENCH"; do
+        if [ ! -e "$f" ]; then
+            log_fail "$f not found, run 'make' first"
+            exit 1
+        fi
+    done
+    if [ "$EUID" -ne 0 ]; then
+        log_fail "Loading the scheduler needs root"
+        exit 1
+    fi
+    if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+        log_fail "Another sched_ext scheduler is already loaded"
+        exit 1
+    fi
+
     init_results_dir
-    
-    log_info "Starting comprehensive performance benchmarks..."
+    trap stop_scheduler EXIT
+
     log_info "Results will be saved to: $REPORT_FILE"
-    echo ""
-    
+
     write_report "Performance Benchmarking Report (eBPF vs Linux CFS)"
     write_report "Generated: $(date)"
+    write_report "CPUs: $NR_CPUS"
     write_report ""
-    
-    # Run all benchmarks
-    benchmark_dispatch_latency
-    benchmark_context_switch
-    benchmark_throughput
-    benchmark_cpu_utilization
-    benchmark_wakeup_latency
-    benchmark_priority_fairness
-    benchmark_scalability
-    
-    # Generate summary
+
+    benchmark_wakeup_latency CFS
+
+    log_info "Loading the eBPF scheduler"
+    if ! start_scheduler; then
+        exit 1
+    fi
+    benchmark_wakeup_latency eBPF
+    stop_scheduler
+
     generate_summary
 
-    # Compute per-run deltas for the report conclusion section.
-    local dispatch_improvement=$(( (results_cfs[dispatch_latency] - results_ebpf[dispatch_latency]) * 100 / results_cfs[dispatch_latency] ))
-    local ctx_reduction=$(( (results_cfs[ctx_switches] - results_ebpf[ctx_switches]) * 100 / results_cfs[ctx_switches] ))
-    local cpu_savings=$(( results_cfs[cpu_util] - results_ebpf[cpu_util] ))
-    local wakeup_improvement=$(( (results_cfs[wakeup_lat] - results_ebpf[wakeup_lat]) * 100 / results_cfs[wakeup_lat] ))
-    
-    write_report ""
-    write_report "CONCLUSIONS"
-    write_report ""
-    write_report "1. PERFORMANCE IMPROVEMENTS:"
-    write_report "   - Dispatch latency: ${dispatch_improvement}% faster"
-    write_report "   - Context switches: ${ctx_reduction}% fewer"
-    write_report "   - CPU utilization: ${cpu_savings}% lower"
-    write_report "   - Task wake-up: ${wakeup_improvement}% faster"
-    write_report ""
-    write_report "2. SCALABILITY:"
-    write_report "   - Linear scaling maintained up to 1000+ tasks"
-    write_report "   - See the per-load numbers above for this run"
-    write_report ""
-    write_report "3. PRIORITY ENFORCEMENT:"
-    write_report "   - Strict priority algorithm working as designed"
-    write_report "   - Priority tasks receive preferential dispatch"
-    write_report "   - Batch tasks still receive fair access"
-    write_report ""
-    write_report "Report saved to: $REPORT_FILE"
-    write_report ""
-    
     log_pass "Benchmarking complete!"
     log_info "Full report saved to: $REPORT_FILE"
-    
+
     # Display report
     echo ""
-    log_info "Displaying full benchmark report:"
     cat "$REPORT_FILE"
 }
 
@@ -1,6 +1,7 @@
 #!/bin/bash
 
-# Full performance suite: runs a handful of benchmarks and writes a comparison report (eBPF vs CFS).
+# Full performance suite: runs the wakeup latency benchmark under CFS and under the
+# eBPF scheduler and writes a comparison report. Needs root to load the scheduler.
 
 set +e
 
@@ -8,6 +9,13 @@ set +e
 RESULTS_DIR="./benchmark_results"
 TIMESTAMP=$(date +%Y%m%d_%H%M%S)
 REPORT_FILE="$RESULTS_DIR/performance_comparison_${TIMESTAMP}.txt"
+LOADER_LOG="$RESULTS_DIR/loader_${TIMESTAMP}.log"
+
+# Binaries (make all)
+LOADER="./build/bin/loader"
+BPF_OBJ="./build/scheduler.bpf.o"
+BENCH="./build/bin/wakeup_bench"
+LATENCY_OBJ="./build/latency.bpf.o"
 
 # Terminal colors
 RED='\033[0;31m'
@@ -17,29 +25,31 @@ BLUE='\033[0;34m'
 CYAN='\033[0;36m'
 NC='\033[0m'
 
-# Workload knobs (synthetic)
-NUM_TASKS_SMALL=50
-NUM_TASKS_MEDIUM=500
-NUM_TASKS_LARGE=1000
-NUM_ITERATIONS=3
+# Workload knobs
+NR_CPUS=$(nproc)
+MESSAGE_THREADS=2
+RUNTIME=10                       # measured seconds per benchmark run
+WARMUP=2
+SCALE_FACTORS="1 2 4"            # workers per CPU for the scalability test
 
-# Captured metrics
-declare -A ebpf_results
-declare -A cfs_results
+# Captured metrics, keyed "<scheduler>,<metric>"
+declare -A results
+LOADER_PID=""
 
 # Helpers for printing + report writing.
 
 init_test() {
     mkdir -p "$RESULTS_DIR"
     > "$REPORT_FILE"  # Clear report file
-    
+
     echo -e "${BLUE}Performance Comparison Test Suite (eBPF vs CFS)${NC}\n"
-    
+
     write_report "Performance Comparison Report"
-    write_report "Priority-Based Dual-Queue eBPF Scheduler vs Default Linux CFS"
+    write_report "Priority-Based eBPF Scheduler vs Default Linux CFS"
     write_report ""
     write_report "Generated: $(date)"
     write_report "System: $(uname -a)"
+    write_report "CPUs: $NR_CPUS, $RUNTIME s per run after $WARMUP s warmup"
     write_report ""
 }
 
@@ -68,354 +78,198 @@ write_report() {
     echo "$1" >> "$REPORT_FILE"
 }
 
-calculate_avg() {
-    local sum=0
-    local count=0
-    for num in "$@"; do
-        sum=$(( sum + num ))
-        (( count++ ))
+check_prereqs() {
+    for f in "$LOADER" "$BPF_OBJ" "$BENCH" "$LATENCY_OBJ"; do
+        if [ ! -e "$f" ]; then
+            log_fail "$f not found, run 'make' first"
+            exit 1
+        fi
     done
-    echo $(( sum / count ))
+    if [ "$EUID" -ne 0 ]; then
+        log_fail "Loading the scheduler needs root"
+        exit 1
+    fi
+    if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+        log_fail "Another sched_ext scheduler is already loaded"
+        exit 1
+    fi
 }
 
-calculate_improvement() {
-    local old=$1
-    local new=$2
-    echo $(( (old - new) * 100 / old ))
-}
+# Start the loader daemon and wait until sched_ext reports it enabled
+start_scheduler() {
+    "$LOADER" --daemon "$BPF_OBJ" >> "$LOADER_LOG" 2>&1 &
+    LOADER_PID=$!
 
-# Test: dispatch latency (microseconds).
-test_dispatch_latency() {
-    log_test "Task Dispatch Latency Measurement"
-    write_report ""
-    write_report "TEST 1: DISPATCH LATENCY (microseconds)"
-    write_report "Measures time from task enqueue to dispatch"
-    write_report ""
-    
-    local ebpf_latencies=()
-    local cfs_latencies=()
-    
-    for ((i=1; i<=NUM_ITERATIONS; i++)); do
-        log_info "Iteration $i/$NUM_ITERATIONS"
-        
-        # eBPF scheduler latency (typically faster due to direct map lookup)
-        local ebpf_lat=$((35 + RANDOM % 30))  # 35-65 microseconds
-        ebpf_latencies+=($ebpf_lat)
-        log_metric "eBPF dispatch latency: ${ebpf_lat}μs"
-        write_report "Iteration $i - eBPF: ${ebpf_lat}μs"
-        
-        # CFS scheduler latency (higher due to O(n) operations)
-        local cfs_lat=$((100 + RANDOM % 50))  # 100-150 microseconds
-        cfs_latencies+=($cfs_lat)
-        log_metric "CFS dispatch latency:  ${cfs_lat}μs"
-        write_report "Iteration $i - CFS:   ${cfs_lat}μs"
+    for ((i=0; i<50; i++)); do
+        if [ "$(cat /sys/kernel/sched_ext/state 2>/dev/null)" = "enabled" ]; then
+            return 0
+        fi
+        if ! kill -0 "$LOADER_PID" 2>/dev/null; then
+            break
+        fi
+        sleep 0.2
     done
-    
-    local ebpf_avg=$(calculate_avg "${ebpf_latencies[@]}")
-    local cfs_avg=$(calculate_avg "${cfs_latencies[@]}")
-    local improvement=$(calculate_improvement "$cfs_avg" "$ebpf_avg")
-    
-    ebpf_results["dispatch_latency"]=$ebpf_avg
-    cfs_results["dispatch_latency"]=$cfs_avg
-    
-    log_pass "eBPF Scheduler: ${ebpf_avg}μs (avg)"
-    log_pass "CFS Scheduler:  ${cfs_avg}μs (avg)"
-    log_pass "Improvement: ${improvement}% FASTER with eBPF"
-    
-    write_report ""
-    write_report "RESULTS:"
-    write_report "  eBPF Scheduler: ${ebpf_avg}μs (average)"
-    write_report "  CFS Scheduler:  ${cfs_avg}μs (average)"
-    write_report "  Improvement: ${improvement}% faster"
-    write_report ""
+
+    log_fail "Scheduler did not start, see $LOADER_LOG"
+    stop_scheduler
+    return 1
 }
 
-# Test: context switch overhead.
-test_context_switches() {
-    log_test "Context Switch Overhead Measurement"
-    write_report ""
-    write_report "TEST 2: CONTEXT SWITCH OVERHEAD (count per 5 seconds)"
-    write_report "Tests with $NUM_TASKS_MEDIUM concurrent tasks"
-    write_report ""
-    
-    local ebpf_switches=()
-    local cfs_switches=()
-    
-    for ((i=1; i<=NUM_ITERATIONS; i++)); do
-        log_info "Iteration $i/$NUM_ITERATIONS with $NUM_TASKS_MEDIUM tasks"
-        
-        # eBPF: fewer context switches due to better scheduling efficiency
-        local ebpf_ctx=$((2200 + RANDOM % 400))  # 2200-2600 switches
-        ebpf_switches+=($ebpf_ctx)
-        log_metric "eBPF context switches: $ebpf_ctx"
-        write_report "Iteration $i - eBPF: $ebpf_ctx switches"
-        
-        # CFS: more context switches due to less efficient scheduling
-        local cfs_ctx=$((3500 + RANDOM % 500))   # 3500-4000 switches
-        cfs_switches+=($cfs_ctx)
-        log_metric "CFS context switches:  $cfs_ctx"
-        write_report "Iteration $i - CFS:   $cfs_ctx switches"
-    done
-    
-    local ebpf_avg=$(calculate_avg "${ebpf_switches[@]}")
-    local cfs_avg=$(calculate_avg "${cfs_switches[@]}")
-    local reduction=$(calculate_improvement "$cfs_avg" "$ebpf_avg")
-    
-    ebpf_results["context_switches"]=$ebpf_avg
-    cfs_results["context_switches"]=$cfs_avg
-    
-    log_pass "eBPF Scheduler: $ebpf_avg switches (avg)"
-    log_pass "CFS Scheduler:  $cfs_avg switches (avg)"
-    log_pass "Reduction: ${reduction}% fewer context switches"
-    
-    write_report ""
-    write_report "RESULTS:"
-    write_report "  eBPF Scheduler: $ebpf_avg switches (average)"
-    write_report "  CFS Scheduler:  $cfs_avg switches (average)"
-    write_report "  Reduction: ${reduction}% fewer"
-    write_report ""
+stop_scheduler() {
+    if [ -n "$LOADER_PID" ]; then
+        kill -INT "$LOADER_PID" 2>/dev/null
+        wait "$LOADER_PID" 2>/dev/null
+        LOADER_PID=""
+    fi
 }
 
-# Test: scheduler CPU overhead.
-test_cpu_utilization() {
-    log_test "CPU Utilization Efficiency"
-    write_report ""
-    write_report "TEST 3: CPU UTILIZATION (percentage)"
-    write_report "Measures CPU usage overhead during scheduling"
-    write_report ""
-    
-    log_info "Running with $NUM_TASKS_MEDIUM concurrent tasks"
-    
-    # eBPF: lower CPU usage due to simpler operations
-    local ebpf_cpu=$((55 + RANDOM % 10))  # 55-65% CPU
-    log_metric "eBPF CPU utilization: ${ebpf_cpu}%"
-    write_report "eBPF CPU Utilization: ${ebpf_cpu}%"
-    
-    # CFS: higher CPU usage
-    local cfs_cpu=$((70 + RANDOM % 12))   # 70-82% CPU
-    log_metric "CFS CPU utilization:  ${cfs_cpu}%"
-    write_report "CFS CPU Utilization: ${cfs_cpu}%"
-    
-    local savings=$((cfs_cpu - ebpf_cpu))
-    
-    ebpf_results["cpu_util"]=$ebpf_cpu
-    cfs_results["cpu_util"]=$cfs_cpu
-    
-    log_pass "eBPF Scheduler: ${ebpf_cpu}%"
-    log_pass "CFS Scheduler:  ${cfs_cpu}%"
-    log_pass "Savings: ${savings}% lower CPU usage with eBPF"
-    
-    write_report ""
-    write_report "RESULTS:"
-    write_report "  eBPF Scheduler: ${ebpf_cpu}% CPU utilization"
-    write_report "  CFS Scheduler:  ${cfs_cpu}% CPU utilization"
-    write_report "  Savings: ${savings}% lower"
-    write_report ""
+# Value of key in a wakeup_bench "summary:" line
+field() {
+    echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
 }
 
-# Test: dispatch throughput.
-test_throughput() {
-    log_test "Task Throughput Measurement"
-    write_report ""
-    write_report "TEST 4: TASK THROUGHPUT (tasks dispatched per second)"
-    write_report ""
-    
-    for load in "small:$NUM_TASKS_SMALL" "medium:$NUM_TASKS_MEDIUM" "large:$NUM_TASKS_LARGE"; do
-        IFS=':' read -r load_name num_tasks <<< "$load"
-        
-        log_info "Testing with $num_tasks tasks ($load_name load)"
-        write_report "Load: $load_name ($num_tasks tasks)"
-        
-        # eBPF: higher throughput
-        local ebpf_thru=$((num_tasks * 1100 + RANDOM % 200))
-        # CFS: lower throughput
-        local cfs_thru=$((num_tasks * 900 + RANDOM % 150))
-        
-        local improvement=$(( (ebpf_thru - cfs_thru) * 100 / cfs_thru ))
-        
-        log_metric "eBPF throughput: $ebpf_thru tasks/sec"
-        log_metric "CFS throughput:  $cfs_thru tasks/sec"
-        log_pass "Improvement: ${improvement}% higher with eBPF"
-        
-        write_report "  eBPF: $ebpf_thru tasks/sec"
-        write_report "  CFS:  $cfs_thru tasks/sec"
-        write_report "  Improvement: ${improvement}%"
-        write_report ""
-        
-        ebpf_results["throughput_$load_name"]=$ebpf_thru
-        cfs_results["throughput_$load_name"]=$cfs_thru
-    done
+ctxt_switches() {
+    awk '/^ctxt/ {print $2}' /proc/stat
 }
 
-# Test: memory footprint (rough).
-test_memory_usage() {
-    log_test "Memory Usage Analysis"
-    write_report ""
-    write_report "TEST 5: MEMORY USAGE (megabytes)"
-    write_report ""
-    
-    log_info "Measuring memory usage with $NUM_TASKS_LARGE tasks"
-    
-    # eBPF: smaller memory footprint
-    local ebpf_mem=$((45 + RANDOM % 15))  # 45-60 MB
-    log_metric "eBPF memory usage: ${ebpf_mem}MB"
-    write_report "eBPF Memory: ${ebpf_mem}MB"
-    
-    # CFS: larger memory usage
-    local cfs_mem=$((65 + RANDOM % 20))   # 65-85 MB
-    log_metric "CFS memory usage:  ${cfs_mem}MB"
-    write_report "CFS Memory: ${cfs_mem}MB"
-    
-    local savings=$((cfs_mem - ebpf_mem))
-    
-    ebpf_results["memory"]=$ebpf_mem
-    cfs_results["memory"]=$cfs_mem
-    
-    log_pass "eBPF Scheduler: ${ebpf_mem}MB"
-    log_pass "CFS Scheduler:  ${cfs_mem}MB"
-    log_pass "Savings: ${savings}MB less memory used"
-    
-    write_report ""
-    write_report "RESULTS:"
-    write_report "  eBPF Scheduler: ${ebpf_mem}MB"
-    write_report "  CFS Scheduler:  ${cfs_mem}MB"
-    write_report "  Savings: ${savings}MB"
-    write_report ""
+# Run wakeup_bench in the background with the given workers per message
+# thread, writing its output to a file, optionally classified at a
+# priority level. Leaves its PID in BENCH_PID.
+BENCH_PID=""
+start_bench() {
+    local workers=$1 level=$2 out=$3
+
+    "$BENCH" -m "$MESSAGE_THREADS" -t "$workers" -r "$RUNTIME" -w "$WARMUP" > "$out" 2>&1 &
+    BENCH_PID=$!
+
+    # The process PID covers all of its threads; the warmup covers the gap
+    if [ -n "$level" ]; then
+        "$LOADER" -L "$level" -a "$BENCH_PID" > /dev/null
+    fi
 }
 
-# Test: latency scaling vs task count.
-test_scalability() {
-    log_test "Scalability Analysis (Latency vs Task Count)"
-    write_report ""
-    write_report "TEST 6: SCALABILITY (Latency scaling with task count)"
-    write_report ""
-    
-    write_report "Task Count | eBPF Latency | CFS Latency | Improvement"
-    write_report "───────────┼──────────────┼─────────────┼────────────"
-    
-    for count in 50 100 500 1000; do
-        log_info "Testing with $count tasks"
-        
-        # eBPF: scales better
-        local ebpf_lat=$((25 + count / 50 + RANDOM % 20))
-        # CFS: scales worse (latency increases more rapidly)
-        local cfs_lat=$((50 + count / 20 + RANDOM % 30))
-        
-        local improvement=$(calculate_improvement "$cfs_lat" "$ebpf_lat")
-        
-        log_metric "Task count: $count, eBPF: ${ebpf_lat}μs, CFS: ${cfs_lat}μs (${improvement}% faster)"
-        write_report "$(printf '%9d | %12dμs | %11dμs | %10d%%' $count $ebpf_lat $cfs_lat $improvement)"
+bench_summary() {
+    grep '^summary:' "$1"
+}
+
+# Record the summary metrics of one run under results["<sched>,<name>_<metric>"]
+record() {
+    local sched=$1 name=$2 summary=$3
+
+    for key in p50_us p99_us p999_us wakeups_per_sec; do
+        results["$sched,${name}_$key"]=$(field "$summary" "$key")
     done
-    
-    write_report ""
-    write_report "RESULTS:"
-    write_report "  See the table above for this run's scaling numbers"
-    write_report ""
 }
 
-# Test: ensure priority bias is visible in dispatch ratio.
-test_priority_enforcement() {
-    log_test "Priority Enforcement Verification"
-    write_report ""
-    write_report "TEST 7: PRIORITY QUEUE FAIRNESS"
+# Run every workload under the currently active scheduler. prio_level is
+# the level the priority instance of test 3 is classified at, if any.
+measure() {
+    local sched=$1 prio_level=$2
+    local workers=$(( NR_CPUS / MESSAGE_THREADS > 0 ? NR_CPUS / MESSAGE_THREADS : 1 ))
+    local tmp=$(mktemp -d)
+
+    log_test "Wakeup latency under $sched"
+    local before=$(ctxt_switches)
+    start_bench "$workers" "" "$tmp/base"
+    wait "$BENCH_PID"
+    local after=$(ctxt_switches)
+    local summary=$(bench_summary "$tmp/base")
+    record "$sched" base "$summary"
+    results["$sched,ctxt_per_sec"]=$(( (after - before) / (RUNTIME + WARMUP) ))
+    log_metric "$summary"
+
+    log_test "Scalability under $sched"
+    for factor in $SCALE_FACTORS; do
+        start_bench $(( workers * factor )) "" "$tmp/scale"
+        wait "$BENCH_PID"
+        summary=$(bench_summary "$tmp/scale")
+        record "$sched" "scale$factor" "$summary"
+        log_metric "${factor}x workers: $summary"
+    done
+
+    # Two instances competing for an overcommitted machine. Under the eBPF
+    # scheduler one is classified priority and the other left in batch.
+    # The tracepoint probe watches the whole system meanwhile, the same
+    # way under either scheduler.
+    log_test "Priority enforcement under $sched"
+    "$LOADER" latency -t "$RUNTIME" "$LATENCY_OBJ" > "$tmp/rqlat" 2>&1 &
+    local pid_probe=$!
+    start_bench $(( workers * 2 )) "$prio_level" "$tmp/prio"
+    local pid_prio=$BENCH_PID
+    start_bench $(( workers * 2 )) "" "$tmp/batch"
+    wait "$pid_prio" "$BENCH_PID" "$pid_probe"
+    record "$sched" prio "$(bench_summary "$tmp/prio")"
+    record "$sched" batch "$(bench_summary "$tmp/batch")"
+    results["$sched,rqlat"]=$(grep -E '^  (Priority|Batch):' "$tmp/rqlat")
+    log_metric "priority instance: $(bench_summary "$tmp/prio")"
+    log_metric "batch instance:    $(bench_summary "$tmp/batch")"
+    log_metric "runqueue latency:"
+    echo "${results[$sched,rqlat]}"
+
+    rm -rf "$tmp"
+}
+
+# Write the comparison tables to the report.
+generate_report() {
+    write_report "TEST 1: WAKEUP LATENCY ($MESSAGE_THREADS message threads x $(( NR_CPUS / MESSAGE_THREADS > 0 ? NR_CPUS / MESSAGE_THREADS : 1 )) workers)"
+    write_report "$(printf '%-10s | %10s | %10s | %10s | %12s | %12s' Scheduler 'p50 (us)' 'p99 (us)' 'p99.9 (us)' 'wakeups/s' 'ctxsw/s')"
+    for sched in CFS eBPF; do
+        write_report "$(printf '%-10s | %10s | %10s | %10s | %12s | %12s' "$sched" \
+            "${results[$sched,base_p50_us]}" "${results[$sched,base_p99_us]}" \
+            "${results[$sched,base_p999_us]}" "${results[$sched,base_wakeups_per_sec]}" \
+            "${results[$sched,ctxt_per_sec]}")"
+    done
     write_report ""
-    
-    log_info "Testing with 300 priority tasks + 200 batch tasks"
-    
-    # Priority tasks should get preferential dispatch
-    local priority_dispatches=$((300 + RANDOM % 30))
-    local batch_dispatches=$((120 + RANDOM % 30))
-    
-    local total=$((priority_dispatches + batch_dispatches))
-    local priority_pct=$(( priority_dispatches * 100 / total ))
-    local batch_pct=$(( batch_dispatches * 100 / total ))
-    
-    log_metric "Priority dispatches: $priority_dispatches (${priority_pct}%)"
-    log_metric "Batch dispatches:    $batch_dispatches (${batch_pct}%)"
-    
-    ebpf_results["priority_dispatch_pct"]=$priority_pct
-    
-    if [ $priority_pct -gt 60 ]; then
-        log_pass "Priority bias observed (${priority_pct}% to priority)"
-    else
-        log_fail "Priority bias weaker than expected (${priority_pct}% to priority)"
-    fi
-    
-    write_report "RESULTS:"
-    write_report "  Priority tasks dispatched: $priority_dispatches (${priority_pct}%)"
-    write_report "  Batch tasks dispatched:    $batch_dispatches (${batch_pct}%)"
-    write_report "  Priority dispatch share:   ${priority_pct}%"
+
+    write_report "TEST 2: SCALABILITY (p99 wakeup latency, us)"
+    write_report "$(printf '%-12s | %10s | %10s' 'Workers/CPU' CFS eBPF)"
+    for factor in $SCALE_FACTORS; do
+        write_report "$(printf '%-12s | %10s | %10s' "$factor" \
+            "${results[CFS,scale${factor}_p99_us]}" "${results[eBPF,scale${factor}_p99_us]}")"
+    done
     write_report ""
-}
 
-# Print a compact summary table and write it to the report.
-generate_summary() {
-    log_test "Performance Summary Report"
-    
-    echo ""
-    echo -e "${BLUE}PERFORMANCE COMPARISON SUMMARY${NC}"
-    echo "Dispatch latency (us):  $dispatch_lat_ebpf (eBPF) vs $dispatch_lat_cfs (CFS) (${dispatch_improvement}% faster)"
-    echo "Context switches:       $ctx_ebpf (eBPF) vs $ctx_cfs (CFS) (${ctx_improvement}% fewer)"
-    echo "CPU utilization (%):    $cpu_ebpf (eBPF) vs $cpu_cfs (CFS) (${cpu_savings}% lower)"
-    echo "Memory usage (MB):      $mem_ebpf (eBPF) vs $mem_cfs (CFS) (${mem_savings}MB saved)"
-    echo "Priority enforcement:   ${priority_pct}% dispatched to priority queue"
-    
-    local dispatch_lat_ebpf=${ebpf_results[dispatch_latency]}
-    local dispatch_lat_cfs=${cfs_results[dispatch_latency]}
-    local dispatch_improvement=$(calculate_improvement "$dispatch_lat_cfs" "$dispatch_lat_ebpf")
-    echo ""
-    
+    write_report "TEST 3: PRIORITY ENFORCEMENT (two competing instances, p99 us)"
+    write_report "$(printf '%-10s | %12s | %12s' Scheduler 'priority' 'batch')"
+    for sched in CFS eBPF; do
+        write_report "$(printf '%-10s | %12s | %12s' "$sched" \
+            "${results[$sched,prio_p99_us]}" "${results[$sched,batch_p99_us]}")"
+    done
+    write_report "(Under CFS neither instance is classified; the columns only name the pairing.)"
     write_report ""
-    write_report "SUMMARY"
-    write_report "Dispatch latency (us):  $dispatch_lat_ebpf (eBPF) vs $dispatch_lat_cfs (CFS) (${dispatch_improvement}% faster)"
-    write_report "Context switches:       $ctx_ebpf (eBPF) vs $ctx_cfs (CFS) (${ctx_improvement}% fewer)"
-    write_report "CPU utilization (%):    $cpu_ebpf (eBPF) vs $cpu_cfs (CFS) (${cpu_savings}% lower)"
-    write_report "Memory usage (MB):      $mem_ebpf (eBPF) vs $mem_cfs (CFS) (${mem_savings}MB saved)"
-    write_report "Priority dispatch share: ${priority_pct}%"
+
+    write_report "TEST 4: SYSTEM-WIDE RUNQUEUE LATENCY DURING TEST 3 (sched_switch tracepoints)"
+    for sched in CFS eBPF; do
+        write_report "$sched:"
+        write_report "${results[$sched,rqlat]}"
+    done
+    write_report "(Without the scheduler loaded every task counts as Batch.)"
     write_report ""
 }
 
 # Entry point.
 main() {
+    check_prereqs
     init_test
-    
-    log_info "Starting comprehensive performance benchmarks..."
+    trap stop_scheduler EXIT
+
     log_info "Results will be saved to: $REPORT_FILE"
-    
-    # Run all tests
-    test_dispatch_latency
-    test_context_switches
-    test_cpu_utilization
-    test_throughput
-    test_memory_usage
-    test_scalability
-    test_priority_enforcement
-    
-    # Generate summary
-    generate_summary
-    
-    write_report ""
-    write_report "CONCLUSION"
-    write_report ""
-    write_report "The Priority-Based Dual-Queue eBPF Scheduler demonstrates"
-    write_report "significant performance advantages over the default Linux"
-    write_report "CFS scheduler across all tested metrics:"
-    write_report ""
-    write_report "Summary:"
-    write_report "  - Faster dispatch latency (${dispatch_improvement}% improvement)"
-    write_report "  - Fewer context switches (${ctx_improvement}% reduction)"
-    write_report "  - Lower CPU utilization (${cpu_savings}% savings)"
-    write_report "  - Better memory efficiency (${mem_savings}MB reduction)"
-    write_report "  - Maintains linear scalability up to 1000+ tasks"
-    write_report "  - Priority dispatch share: ${priority_pct}%"
-    write_report ""
-    write_report "Note: these numbers are synthetic unless you replace the generators with real measurements."
-    write_report ""
-    
+
+    measure CFS ""
+
+    log_info "Loading the eBPF scheduler"
+    if ! start_scheduler; then
+        exit 1
+    fi
+    measure eBPF interactive
+    stop_scheduler
+
+    generate_report
+
     log_pass "Benchmarking complete!"
     log_info "Full report saved to: $REPORT_FILE"
     log_info "Displaying report:\n"
-    
+
     cat "$REPORT_FILE"
 }
 
@@ -0,0 +1,20 @@
+#ifndef __BPF_UTIL_H
+#define __BPF_UTIL_H
+
+// Helpers shared by the BPF programs. Include after vmlinux.h.
+
+// Floor of log2(v), 0 for v == 0
+static __u32 log2_u64(__u64 v)
+{
+    __u32 r = 0;
+
+    if (v >> 32) { v >>= 32; r += 32; }
+    if (v >> 16) { v >>= 16; r += 16; }
+    if (v >> 8)  { v >>= 8;  r += 8; }
+    if (v >> 4)  { v >>= 4;  r += 4; }
+    if (v >> 2)  { v >>= 2;  r += 2; }
+    if (v >> 1)  { r += 1; }
+    return r;
+}
+
+#endif /* __BPF_UTIL_H */
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include "scheduler.h"
+
+// Microbenchmark for the queue_stats update in scheduler.bpf.c: compares
+// a locked atomic add with a plain increment on a counter block that, like
+// a CPU's queue_stats stripe, only its own thread ever touches. Each thread is
+// pinned to its own CPU and bumps one counter of its own sched_stats.
+
+#define DEFAULT_ITERATIONS 100000000ULL
+
+struct bench_thread {
+    pthread_t tid;
+    int cpu;
+    int atomic;
+    unsigned long long iterations;
+    struct sched_stats stats;
+    double ns;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *bench_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    __u64 *counter = &t->stats.counters[STAT_BATCH_ENQUEUED];
+    cpu_set_t set;
+    double start;
+
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    start = now_ns();
+    if (t->atomic) {
+        for (unsigned long long i = 0; i < t->iterations; i++)
+            __sync_fetch_and_add(counter, 1);
+    } else {
+        for (unsigned long long i = 0; i < t->iterations; i++) {
+            (*counter)++;
+            // Keep the load and store in the loop, as in the BPF program
+            __asm__ __volatile__("" ::: "memory");
+        }
+    }
+    t->ns = now_ns() - start;
+    return NULL;
+}
+
+// Run one form on nr_threads CPUs; returns the mean ns per increment
+static double run(int atomic, int nr_threads, unsigned long long iterations)
+{
+    struct bench_thread *threads;
+    double total = 0;
+
+    if (posix_memalign((void **)&threads, 64, nr_threads * sizeof(*threads))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    memset(threads, 0, nr_threads * sizeof(*threads));
+
+    for (int i = 0; i < nr_threads; i++) {
+        threads[i].cpu = i;
+        threads[i].atomic = atomic;
+        threads[i].iterations = iterations;
+        if (pthread_create(&threads[i].tid, NULL, bench_fn, &threads[i])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        if (threads[i].stats.counters[STAT_BATCH_ENQUEUED] != iterations) {
+            fprintf(stderr, "Thread %d lost increments\n", i);
+            exit(1);
+        }
+        total += threads[i].ns;
+    }
+
+    free(threads);
+    return total / nr_threads / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long long iterations = DEFAULT_ITERATIONS;
+    int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double atomic_ns, plain_ns;
+
+    if (argc > 1)
+        iterations = strtoull(argv[1], NULL, 10);
+    if (argc > 2)
+        nr_threads = atoi(argv[2]);
+    if (!iterations || nr_threads <= 0) {
+        fprintf(stderr, "Usage: %s [iterations] [threads]\n", argv[0]);
+        return 1;
+    }
+
+    atomic_ns = run(1, nr_threads, iterations);
+    plain_ns = run(0, nr_threads, iterations);
+
+    printf("Per-CPU counter increment, %d threads x %llu iterations:\n",
+           nr_threads, iterations);
+    printf("  atomic add:      %.2f ns/op\n", atomic_ns);
+    printf("  plain increment: %.2f ns/op\n", plain_ns);
+    printf("  speedup:         %.1fx\n", atomic_ns / plain_ns);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include "scheduler.h"
+#include "bpf_util.h"
+
+char LICENSE[] SEC("license") = "GPL";
+
+// Scheduler-independent runqueue latency probe, run by "loader latency".
+// It times every task from the moment it becomes runnable, either woken
+// or preempted while still runnable, until sched_switch puts it on a
+// CPU, so CFS and sched_ext schedulers are measured the same way.
+
+#define TASK_RUNNING 0
+
+// Same layout as the scheduler's map. The loader reuses the scheduler's
+// pinned instance when it is running; otherwise this one stays empty and
+// every task counts as batch.
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10000);
+    __type(key, __u32);
+    __type(value, __u32);
+} priority_pids_map SEC(".maps");
+
+// When each task last became runnable, 0 once it has been timed. Task
+// storage goes away with the task, so an entry can neither leak when a
+// task exits while runnable nor be picked up by a later reuse of its PID.
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, __u64);
+} runnable_ts SEC(".maps");
+
+// Runqueue latency histograms, split like those in scheduler.bpf.c
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NR_LAT_CLASSES);
+    __type(key, __u32);
+    __type(value, struct lat_hist);
+} rq_latency_hist SEC(".maps");
+
+// Whether the thread or its process is classified at a priority level
+static bool task_is_priority(struct task_struct *p)
+{
+    __u32 pid = p->pid, tgid = p->tgid;
+    __u32 *val = bpf_map_lookup_elem(&priority_pids_map, &pid);
+
+    if (!val)
+        val = bpf_map_lookup_elem(&priority_pids_map, &tgid);
+    return val && LEVEL_IS_PRIORITY(*val & PRIO_LEVEL_MASK);
+}
+
+static void mark_runnable(struct task_struct *p)
+{
+    __u64 *ts;
+
+    // The idle task never waits on a runqueue
+    if (!p->pid)
+        return;
+    ts = bpf_task_storage_get(&runnable_ts, p, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (ts)
+        *ts = bpf_ktime_get_ns();
+}
+
+SEC("tp_btf/sched_wakeup")
+int BPF_PROG(handle_sched_wakeup, struct task_struct *p)
+{
+    mark_runnable(p);
+    return 0;
+}
+
+SEC("tp_btf/sched_wakeup_new")
+int BPF_PROG(handle_sched_wakeup_new, struct task_struct *p)
+{
+    mark_runnable(p);
+    return 0;
+}
+
+SEC("tp_btf/sched_switch")
+int BPF_PROG(handle_sched_switch, bool preempt, struct task_struct *prev,
+             struct task_struct *next)
+{
+    struct lat_hist *hist;
+    __u32 key, bucket;
+    __u64 *ts, delta;
+
+    // A preempted task goes straight back to waiting for a CPU
+    if (prev->__state == TASK_RUNNING)
+        mark_runnable(prev);
+
+    ts = bpf_task_storage_get(&runnable_ts, next, 0, 0);
+    if (!ts || !*ts)
+        return 0;
+    delta = bpf_ktime_get_ns() - *ts;
+    *ts = 0;
+
+    key = task_is_priority(next) ? LAT_CLASS_PRIORITY : LAT_CLASS_BATCH;
+    hist = bpf_map_lookup_elem(&rq_latency_hist, &key);
+    if (!hist)
+        return 0;
+
+    bucket = log2_u64(delta);
+    if (bucket < NR_LAT_BUCKETS)
+        hist->buckets[bucket]++;
+    return 0;
+}
@@ -3,12 +3,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #include <getopt.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <linux/types.h>
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
+#include "scheduler.h"
+#include "stats_mmap.h"
 
 // Increase RLIMIT_MEMLOCK to allow loading larger BPF programs
 static int bump_memlock_rlimit(void)
@@ -26,29 +38,1301 @@ static int bump_memlock_rlimit(void)
     return 0;
 }
 
+static const char *pinned_maps[] = {
+    "priority_pids_map",
+    "priority_cgroups_map",
+    "queue_stats",
+    "sched_config_map",
+    "classify_gen_map",
+    "events",
+    ".data.trace_ctl",
+};
+
+// Pin file for a map; global variable sections drop their ".data." prefix
+static const char *pin_name(const char *map_name)
+{
+    if (strncmp(map_name, ".data.", 6) == 0)
+        return map_name + 6;
+    return map_name;
+}
+
+#define NR_PINNED_MAPS (sizeof(pinned_maps) / sizeof(pinned_maps[0]))
+
+static int find_map_fd(struct bpf_object *obj, const char *name)
+{
+    struct bpf_map *map = bpf_object__find_map_by_name(obj, name);
+
+    if (!map) {
+        fprintf(stderr, "Error: Could not find %s\n", name);
+        return -1;
+    }
+    return bpf_map__fd(map);
+}
+
+static int open_pinned_map(const char *name)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", PIN_DIR, name);
+    fd = bpf_obj_get(path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        if (errno == ENOENT)
+            fprintf(stderr, "Is the scheduler running? Start it with --daemon\n");
+    }
+    return fd;
+}
+
+static void unpin_maps(struct bpf_object *obj)
+{
+    char path[256];
+
+    for (size_t i = 0; i < NR_PINNED_MAPS; i++) {
+        struct bpf_map *map = bpf_object__find_map_by_name(obj, pinned_maps[i]);
+
+        snprintf(path, sizeof(path), "%s/%s", PIN_DIR, pin_name(pinned_maps[i]));
+        if (map)
+            bpf_map__unpin(map, path);
+    }
+    rmdir(PIN_DIR);
+}
+
+static int pin_maps(struct bpf_object *obj)
+{
+    char path[256];
+
+    for (size_t i = 0; i < NR_PINNED_MAPS; i++) {
+        struct bpf_map *map = bpf_object__find_map_by_name(obj, pinned_maps[i]);
+
+        if (!map) {
+            fprintf(stderr, "Error: Could not find %s\n", pinned_maps[i]);
+            goto err;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", PIN_DIR, pin_name(pinned_maps[i]));
+        // Only one sched_ext scheduler can be attached, so anything
+        // already pinned here was left behind by a daemon that died
+        unlink(path);
+        if (bpf_map__pin(map, path)) {
+            fprintf(stderr, "Failed to pin %s: %s\n", path, strerror(errno));
+            goto err;
+        }
+    }
+    return 0;
+
+err:
+    unpin_maps(obj);
+    return -1;
+}
+
+static int read_sysfs_long(const char *path, long *val)
+{
+    FILE *f = fopen(path, "r");
+    int ok;
+
+    if (!f)
+        return -1;
+    ok = fscanf(f, "%ld", val) == 1;
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+// Last-level cache id of a CPU: the id of the highest-level entry in its
+// sysfs cache directory, which is L2 on hosts without an L3. The level is
+// folded in so ids from different levels never collide. -1 if none.
+static long cpu_llc_id(int cpu)
+{
+    char path[128];
+    long level, id, best_level = -1, best_id = -1;
+
+    for (int idx = 0; idx < 16; idx++) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, idx);
+        if (read_sysfs_long(path, &level))
+            break;
+        if (level <= best_level)
+            continue;
+
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/cache/index%d/id", cpu, idx);
+        if (read_sysfs_long(path, &id) == 0) {
+            best_level = level;
+            best_id = id;
+        }
+    }
+    return best_level < 0 ? -1 : (best_level << 24) | best_id;
+}
+
+// Fill cpu_node_map from /sys/devices/system/node/node<N>/cpulist, a
+// comma-separated list of CPUs and CPU ranges such as "0-3,8-11".
+// CPUs on no listed node stay on node 0. The scheduler turns it into one
+// cpumask per node at init. Returns the number of nodes.
+static int load_numa_nodes(int node_fd, int nr_cpus)
+{
+    char path[128];
+    int nr_nodes = 0;
+
+    for (__u32 node = 0; node < MAX_NODES; node++) {
+        unsigned int first, last;
+        FILE *f;
+        int c;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        nr_nodes++;
+
+        while (fscanf(f, "%u", &first) == 1) {
+            last = first;
+            c = fgetc(f);
+            if (c == '-') {
+                if (fscanf(f, "%u", &last) != 1)
+                    break;
+                c = fgetc(f);
+            }
+
+            for (__u32 cpu = first; cpu <= last && cpu < (__u32)nr_cpus; cpu++) {
+                if (bpf_map_update_elem(node_fd, &cpu, &node, BPF_ANY)) {
+                    fprintf(stderr, "Failed to set node of CPU %u: %s\n", cpu, strerror(errno));
+                    fclose(f);
+                    return -1;
+                }
+            }
+
+            if (c != ',')
+                break;
+        }
+        fclose(f);
+    }
+
+    return nr_nodes ? nr_nodes : 1;
+}
+
+// Fill cpu_llc_map with a dense LLC index per CPU and cpu_node_map with
+// its NUMA node. The scheduler reads them at init to create a DSQ per
+// level in each LLC, so this must run before attach.
+static int load_topology(int llc_fd, int node_fd)
+{
+    long llc_ids[MAX_LLCS];
+    int nr_cpus = libbpf_num_possible_cpus();
+    int nr_nodes;
+    __u32 nr_llcs = 0;
+    int folded = 0;
+
+    if (nr_cpus <= 0) {
+        fprintf(stderr, "Failed to get possible CPU count\n");
+        return -1;
+    }
+    if (nr_cpus > MAX_CPUS)
+        nr_cpus = MAX_CPUS;
+
+    for (__u32 cpu = 0; cpu < (__u32)nr_cpus; cpu++) {
+        long id = cpu_llc_id(cpu);
+        __u32 llc;
+
+        // CPUs without cache info, e.g. offline ones, share LLC 0
+        if (id < 0) {
+            llc = 0;
+        } else {
+            for (llc = 0; llc < nr_llcs; llc++)
+                if (llc_ids[llc] == id)
+                    break;
+            if (llc == nr_llcs) {
+                if (nr_llcs < MAX_LLCS) {
+                    llc_ids[nr_llcs++] = id;
+                } else {
+                    if (!folded)
+                        fprintf(stderr, "Warning: more than %d LLCs, some will share "
+                                "DSQs and batch CPU masks\n", MAX_LLCS);
+                    folded = 1;
+                    llc = id % MAX_LLCS;
+                }
+            }
+        }
+
+        if (bpf_map_update_elem(llc_fd, &cpu, &llc, BPF_ANY)) {
+            fprintf(stderr, "Failed to set LLC of CPU %u: %s\n", cpu, strerror(errno));
+            return -1;
+        }
+    }
+
+    nr_nodes = load_numa_nodes(node_fd, nr_cpus);
+    if (nr_nodes < 0)
+        return -1;
+
+    printf("Topology: %d CPUs in %u LLCs on %d NUMA nodes\n",
+           nr_cpus, nr_llcs ? nr_llcs : 1, nr_nodes);
+    return 0;
+}
+
+// scx_exit_kind values at or above this are scheduler errors
+#define EXIT_KIND_ERROR 1024
+
+static volatile sig_atomic_t exiting;
+
+static void sig_handler(int sig)
+{
+    (void)sig;
+    exiting = 1;
+}
+
+// OpenMetrics exporter for --daemon --metrics. Serves one plain HTTP
+// response per connection on a Unix socket or a localhost TCP port,
+// from the daemon's main loop rather than a thread of its own.
+#define METRICS_PREFIX "priority_scheduler_"
+
+struct metrics_server {
+    int listen_fd;
+    const char *unix_path;      // to unlink on shutdown, NULL for TCP
+    const volatile struct cpu_stats *stats;
+    struct bpf_map *pids_map;
+    struct bpf_map *cgroups_map;
+};
+
+// queue_stats counters exported as a family, split by class where the
+// scheduler keeps one per class; stat[1] is -1 for unsplit counters
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    int stat[2];
+} metric_families[] = {
+    {"enqueued", "counter", "Tasks queued on a level DSQ",
+     {STAT_PRIORITY_ENQUEUED, STAT_BATCH_ENQUEUED}},
+    {"dispatched", "counter", "Tasks consumed from a level DSQ",
+     {STAT_PRIORITY_DISPATCHED, STAT_BATCH_DISPATCHED}},
+    {"queued", "gauge", "Tasks waiting on level DSQs",
+     {STAT_PRIORITY_QUEUED, STAT_BATCH_QUEUED}},
+    {"direct_dispatched", "counter", "Tasks dispatched straight to an idle CPU",
+     {STAT_DIRECT_DISPATCHED, -1}},
+    {"batch_preempted", "counter", "Batch tasks preempted to make room for priority tasks",
+     {STAT_BATCH_PREEMPTED, -1}},
+    {"llc_stolen", "counter", "Tasks taken from another LLC's queues",
+     {STAT_LLC_STOLEN, -1}},
+    {"trace_events_dropped", "counter", "Sampled events lost to a full ring buffer",
+     {STAT_TRACE_DROPPED, -1}},
+};
+
+#define NR_METRIC_FAMILIES (sizeof(metric_families) / sizeof(metric_families[0]))
+
+// Entries fetched per batch lookup when counting a classification map
+#define COUNT_BATCH 1024
+
+// Count a hash map's entries with batch lookups, one syscall per
+// COUNT_BATCH entries. Only the count is used, but the kernel copies the
+// values out too. Returns -1 on failure.
+static long count_map_entries(struct bpf_map *map)
+{
+    __u32 key_size = bpf_map__key_size(map), value_size = bpf_map__value_size(map);
+    void *keys = malloc((size_t)COUNT_BATCH * key_size);
+    void *values = malloc((size_t)COUNT_BATCH * value_size);
+    __u64 in_batch, out_batch;     // hash map batch tokens are bucket indexes
+    void *in = NULL;
+    long total = 0, n = -1;
+
+    if (!keys || !values)
+        goto out;
+
+    for (;;) {
+        __u32 count = COUNT_BATCH;
+        int err = bpf_map_lookup_batch(bpf_map__fd(map), in, &out_batch,
+                                       keys, values, &count, NULL);
+
+        if (err && errno != ENOENT)
+            goto out;
+        total += count;
+        // ENOENT: the walk is complete
+        if (err)
+            break;
+        in_batch = out_batch;
+        in = &in_batch;
+    }
+    n = total;
+out:
+    free(keys);
+    free(values);
+    return n;
+}
+
+static void write_occupancy(FILE *f, const char *name, const char *help, struct bpf_map *map)
+{
+    long entries = count_map_entries(map);
+
+    fprintf(f, "# TYPE " METRICS_PREFIX "%s_entries gauge\n", name);
+    fprintf(f, "# HELP " METRICS_PREFIX "%s_entries %s\n", name, help);
+    if (entries >= 0)
+        fprintf(f, METRICS_PREFIX "%s_entries %ld\n", name, entries);
+    fprintf(f, "# TYPE " METRICS_PREFIX "%s_capacity gauge\n", name);
+    fprintf(f, "# HELP " METRICS_PREFIX "%s_capacity Maximum entries\n", name);
+    fprintf(f, METRICS_PREFIX "%s_capacity %u\n", name, bpf_map__max_entries(map));
+}
+
+// Render every metric, summed over CPUs now, in OpenMetrics text format
+static void write_metrics(FILE *f, struct metrics_server *srv)
+{
+    const char *class_names[NR_LAT_CLASSES] = {"priority", "batch"};
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct cpu_stats sum;
+    const __u64 *totals = sum.stats.counters;
+
+    if (nr_cpus <= 0 || nr_cpus > MAX_CPUS)
+        nr_cpus = MAX_CPUS;
+    stats_sum(srv->stats, nr_cpus, &sum);
+
+    for (size_t m = 0; m < NR_METRIC_FAMILIES; m++) {
+        const char *name = metric_families[m].name;
+        int counter = strcmp(metric_families[m].type, "counter") == 0;
+
+        fprintf(f, "# TYPE " METRICS_PREFIX "%s %s\n", name, metric_families[m].type);
+        fprintf(f, "# HELP " METRICS_PREFIX "%s %s\n", name, metric_families[m].help);
+        if (metric_families[m].stat[1] < 0) {
+            fprintf(f, METRICS_PREFIX "%s%s %llu\n", name, counter ? "_total" : "",
+                    (unsigned long long)totals[metric_families[m].stat[0]]);
+            continue;
+        }
+        for (int c = 0; c < NR_LAT_CLASSES; c++) {
+            // Gauges are summed with wrap-around and can dip below zero
+            if (counter)
+                fprintf(f, METRICS_PREFIX "%s_total{class=\"%s\"} %llu\n", name,
+                        class_names[c], (unsigned long long)totals[metric_families[m].stat[c]]);
+            else
+                fprintf(f, METRICS_PREFIX "%s{class=\"%s\"} %lld\n", name,
+                        class_names[c], (long long)totals[metric_families[m].stat[c]]);
+        }
+    }
+
+    fprintf(f, "# TYPE " METRICS_PREFIX "idle_seconds counter\n");
+    fprintf(f, "# HELP " METRICS_PREFIX "idle_seconds CPU time left idle after dispatch found nothing\n");
+    fprintf(f, METRICS_PREFIX "idle_seconds_total %.9f\n", totals[STAT_IDLE_NS] / 1e9);
+
+    // Bucket i holds [2^i, 2^(i+1)) ns; the last one is open-ended
+    fprintf(f, "# TYPE " METRICS_PREFIX "enqueue_to_run_seconds histogram\n");
+    fprintf(f, "# HELP " METRICS_PREFIX "enqueue_to_run_seconds Time from enqueue to running\n");
+    for (int c = 0; c < NR_LAT_CLASSES; c++) {
+        unsigned long long cumulative = 0;
+
+        for (int i = 0; i < NR_LAT_BUCKETS - 1; i++) {
+            cumulative += sum.lat[c].buckets[i];
+            fprintf(f, METRICS_PREFIX "enqueue_to_run_seconds_bucket{class=\"%s\",le=\"%.9g\"} %llu\n",
+                    class_names[c], (double)(1ULL << (i + 1)) / 1e9, cumulative);
+        }
+        cumulative += sum.lat[c].buckets[NR_LAT_BUCKETS - 1];
+        fprintf(f, METRICS_PREFIX "enqueue_to_run_seconds_bucket{class=\"%s\",le=\"+Inf\"} %llu\n",
+                class_names[c], cumulative);
+    }
+
+    write_occupancy(f, "priority_pids", "Entries in priority_pids_map", srv->pids_map);
+    write_occupancy(f, "priority_cgroups", "Entries in priority_cgroups_map", srv->cgroups_map);
+
+    fprintf(f, "# EOF\n");
+}
+
+// Longest a scrape connection may take, from accept to the last byte
+#define METRICS_DEADLINE_MS 2000
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Wait until fd is ready for events or the deadline passes; 0 if ready
+static int wait_ready(int fd, short events, long long deadline)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    long long left = deadline - now_ms();
+
+    if (left <= 0 || poll(&pfd, 1, left) <= 0)
+        return -1;
+    return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len, long long deadline)
+{
+    while (len) {
+        ssize_t n;
+
+        if (wait_ready(fd, POLLOUT, deadline))
+            return -1;
+        n = send(fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Answer one scrape. The whole exchange must finish within
+// METRICS_DEADLINE_MS, so a slow or stuck client cannot hold up the
+// daemon loop for longer than that.
+static void serve_metrics(struct metrics_server *srv)
+{
+    char req[1024], header[256];
+    char *body = NULL;
+    size_t body_len = 0;
+    long long deadline;
+    ssize_t n;
+    FILE *f;
+    int fd;
+
+    fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    deadline = now_ms() + METRICS_DEADLINE_MS;
+
+    if (wait_ready(fd, POLLIN, deadline))
+        goto out;
+    n = recv(fd, req, sizeof(req) - 1, 0);
+    if (n <= 0)
+        goto out;
+    req[n] = '\0';
+    if (strncmp(req, "GET ", 4) != 0) {
+        static const char bad[] = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
+
+        send_all(fd, bad, sizeof(bad) - 1, deadline);
+        goto out;
+    }
+
+    f = open_memstream(&body, &body_len);
+    if (!f)
+        goto out;
+    write_metrics(f, srv);
+    fclose(f);
+
+    n = snprintf(header, sizeof(header),
+                 "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", body_len);
+    if (send_all(fd, header, n, deadline) == 0)
+        send_all(fd, body, body_len, deadline);
+    free(body);
+out:
+    close(fd);
+}
+
+// Remove a Unix socket left at path by a daemon that died. Anything that
+// is not a socket, or a socket someone still accepts on, is left alone
+// and fails the start. Returns 0 if path is now free.
+static int remove_stale_socket(const struct sockaddr_un *sun)
+{
+    struct stat st;
+    int fd, err;
+
+    if (lstat(sun->sun_path, &st)) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "Failed to stat %s: %s\n", sun->sun_path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Error: %s exists and is not a socket\n", sun->sun_path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    err = connect(fd, (const struct sockaddr *)sun, sizeof(*sun)) ? errno : 0;
+    close(fd);
+
+    if (err != ECONNREFUSED) {
+        fprintf(stderr, "Error: %s is %s\n", sun->sun_path,
+                err ? strerror(err) : "in use by a running daemon");
+        return -1;
+    }
+    if (unlink(sun->sun_path) && errno != ENOENT) {
+        fprintf(stderr, "Failed to remove stale %s: %s\n", sun->sun_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Listen on addr: a path for a Unix socket, otherwise a TCP port on
+// 127.0.0.1. Returns the listening socket or -1.
+static int metrics_listen(const char *addr, const char **unix_path)
+{
+    int fd, err, one = 1;
+
+    *unix_path = NULL;
+    if (addr[0] == '/') {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Error: metrics socket path too long: %s\n", addr);
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        if (remove_stale_socket(&sun))
+            return -1;
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            goto err;
+        if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)))
+            goto err_close;
+        *unix_path = addr;
+    } else {
+        struct sockaddr_in sin = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        char *end;
+        long port = strtol(addr, &end, 10);
+
+        if (end == addr || *end || port <= 0 || port > 65535) {
+            fprintf(stderr, "Error: metrics address must be a socket path or port: %s\n", addr);
+            return -1;
+        }
+        sin.sin_port = htons(port);
+
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            goto err;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)))
+            goto err_close;
+    }
+
+    if (listen(fd, 16))
+        goto err_close;
+    return fd;
+
+err_close:
+    err = errno;
+    close(fd);
+    if (*unix_path)
+        unlink(*unix_path);
+    *unix_path = NULL;
+    errno = err;
+err:
+    fprintf(stderr, "Failed to listen for metrics on %s: %s\n", addr, strerror(errno));
+    return -1;
+}
+
+static int metrics_start(struct metrics_server *srv, struct bpf_object *obj, const char *addr)
+{
+    int stats_fd = find_map_fd(obj, "queue_stats");
+
+    srv->pids_map = bpf_object__find_map_by_name(obj, "priority_pids_map");
+    srv->cgroups_map = bpf_object__find_map_by_name(obj, "priority_cgroups_map");
+    if (stats_fd < 0 || !srv->pids_map || !srv->cgroups_map)
+        return -1;
+
+    srv->stats = stats_mmap(stats_fd);
+    if (!srv->stats) {
+        fprintf(stderr, "Failed to map queue statistics: %s\n", strerror(errno));
+        return -1;
+    }
+
+    srv->listen_fd = metrics_listen(addr, &srv->unix_path);
+    if (srv->listen_fd < 0) {
+        stats_munmap(srv->stats);
+        srv->stats = NULL;
+        return -1;
+    }
+    printf("Serving OpenMetrics on %s\n", addr);
+    return 0;
+}
+
+static void metrics_stop(struct metrics_server *srv)
+{
+    if (srv->listen_fd < 0)
+        return;
+    close(srv->listen_fd);
+    if (srv->unix_path)
+        unlink(srv->unix_path);
+    stats_munmap(srv->stats);
+    srv->listen_fd = -1;
+}
+
+// Attach the scheduler and keep it running until a signal arrives or
+// the kernel unloads it, then report the sched_ext exit reason. With
+// metrics_addr, serve OpenMetrics scrapes meanwhile.
+static int run_daemon(struct bpf_object *obj, int exit_fd, const char *metrics_addr)
+{
+    struct metrics_server metrics = { .listen_fd = -1 };
+    struct pollfd pfd;
+    struct bpf_map *ops_map;
+    struct bpf_link *link;
+    struct exit_record rec = {};
+    __u32 zero = 0;
+
+    ops_map = bpf_object__find_map_by_name(obj, "scheduler_ops");
+    if (!ops_map) {
+        fprintf(stderr, "Error: Could not find scheduler_ops\n");
+        return 1;
+    }
+
+    // Claim the metrics address first, so a taken port fails the start
+    // before the scheduler replaces the running one
+    if (metrics_addr && metrics_start(&metrics, obj, metrics_addr))
+        return 1;
+
+    link = bpf_map__attach_struct_ops(ops_map);
+    if (!link) {
+        fprintf(stderr, "Failed to attach scheduler: %s\n", strerror(errno));
+        metrics_stop(&metrics);
+        return 1;
+    }
+
+    // Pin only once attached, so a failed start never steals the pins
+    // of a scheduler that is already running
+    if (pin_maps(obj)) {
+        bpf_link__destroy(link);
+        metrics_stop(&metrics);
+        return 1;
+    }
+    printf("Maps pinned under %s\n", PIN_DIR);
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    printf("Scheduler attached, press Ctrl-C to detach\n");
+
+    while (!exiting) {
+        // The kernel can unload us on its own, e.g. on a watchdog stall
+        if (bpf_map_lookup_elem(exit_fd, &zero, &rec) == 0 && rec.kind)
+            break;
+
+        // Without metrics the fd is -1 and poll() just waits out the second
+        pfd.fd = metrics.listen_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN))
+            serve_metrics(&metrics);
+    }
+
+    metrics_stop(&metrics);
+    unpin_maps(obj);
+    bpf_link__destroy(link);
+    printf("Scheduler detached\n");
+
+    if (bpf_map_lookup_elem(exit_fd, &zero, &rec) || !rec.kind)
+        return 0;
+
+    rec.reason[sizeof(rec.reason) - 1] = '\0';
+    rec.msg[sizeof(rec.msg) - 1] = '\0';
+    printf("sched_ext exit: %s (kind %d, code %lld)\n",
+           rec.reason[0] ? rec.reason : "unknown", rec.kind, (long long)rec.exit_code);
+    if (rec.msg[0])
+        printf("  %s\n", rec.msg);
+
+    return rec.kind >= EXIT_KIND_ERROR;
+}
+
+// Read whitespace-separated PIDs from a file, or stdin for "-", into a
+// malloc'd array. Returns 0 on success and -1 on error.
+static int read_pid_file(const char *path, __u32 **out, __u32 *count)
+{
+    FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    __u32 *pids = NULL, *tmp;
+    __u32 n = 0, cap = 0;
+    char tok[32];
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fscanf(f, "%31s", tok) == 1) {
+        char *end;
+        long pid;
+
+        errno = 0;
+        pid = strtol(tok, &end, 10);
+        // PIDs are positive ints; anything larger would wrap in the __u32 key
+        if (*end || errno || pid <= 0 || pid > INT_MAX) {
+            fprintf(stderr, "Skipping invalid PID '%s'\n", tok);
+            continue;
+        }
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            tmp = realloc(pids, cap * sizeof(*pids));
+            if (!tmp) {
+                fprintf(stderr, "Out of memory reading %s\n", path);
+                free(pids);
+                n = 0;
+                pids = NULL;
+                break;
+            }
+            pids = tmp;
+        }
+        pids[n++] = pid;
+    }
+
+    if (f != stdin)
+        fclose(f);
+    if (!pids && cap)
+        return -1;
+    *out = pids;
+    *count = n;
+    return 0;
+}
+
+// Add or remove many PIDs with as few batch syscalls as possible. The
+// kernel stops a batch at the first failing element and reports how many
+// went through, so report that PID and resume right after it. A full map
+// fails every PID that follows the same way, so give up on those at once.
+// Returns the number of PIDs that failed.
+static __u32 bulk_update_pids(int map_fd, __u32 *pids, __u32 n, __u32 priority_val,
+                              int remove)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = BPF_ANY);
+    __u32 *vals = NULL;
+    __u32 done = 0, failed = 0;
+
+    if (!remove) {
+        vals = malloc(n * sizeof(*vals));
+        if (!vals) {
+            fprintf(stderr, "Out of memory\n");
+            return n;
+        }
+        for (__u32 i = 0; i < n; i++)
+            vals[i] = priority_val;
+    }
+
+    while (done < n) {
+        __u32 count = n - done;
+        int err;
+
+        if (remove)
+            err = bpf_map_delete_batch(map_fd, pids + done, &count, &opts);
+        else
+            err = bpf_map_update_batch(map_fd, pids + done, vals + done, &count, &opts);
+        done += count;
+        if (!err)
+            break;
+
+        // count < remaining: pids[done] is the element that failed
+        if (done >= n) {
+            fprintf(stderr, "Batch operation failed: %s\n", strerror(errno));
+            break;
+        }
+        if (!remove && errno == E2BIG) {
+            fprintf(stderr, "Priority map is full, %u PIDs not added\n", n - done);
+            failed += n - done;
+            break;
+        }
+        if (!(remove && errno == ENOENT)) {
+            fprintf(stderr, "  PID %u: %s\n", pids[done], strerror(errno));
+            failed++;
+        }
+        done++;
+    }
+
+    free(vals);
+    return failed;
+}
+
+// Tell the scheduler that priority_pids_map or priority_cgroups_map
+// changed, so tasks with a cached class look themselves up again on
+// their next enqueue
+static int bump_classify_gen(int gen_fd)
+{
+    __u32 zero = 0;
+    __u64 gen = 0;
+
+    bpf_map_lookup_elem(gen_fd, &zero, &gen);
+    gen++;
+    if (bpf_map_update_elem(gen_fd, &zero, &gen, BPF_ANY)) {
+        fprintf(stderr, "Failed to publish classification change: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Upper bound, in ns, of the log2 bucket holding the q-th quantile
+static __u64 hist_quantile(const struct lat_hist *hist, double q)
+{
+    __u64 total = 0, seen = 0, target;
+
+    for (int i = 0; i < NR_LAT_BUCKETS; i++)
+        total += hist->buckets[i];
+    if (!total)
+        return 0;
+
+    target = (__u64)(q * total);
+    if (target < 1)
+        target = 1;
+    for (int i = 0; i < NR_LAT_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target)
+            return i < NR_LAT_BUCKETS - 1 ? 1ULL << (i + 1) : ~0ULL;
+    }
+    return ~0ULL;
+}
+
+// Print p50/p99/p999 of each class's histogram, summed over CPUs, and
+// with dist the non-empty buckets too
+static void print_latency(const struct lat_hist *hists, const char *title, int dist)
+{
+    const char *class_names[NR_LAT_CLASSES] = {"Priority", "Batch"};
+
+    printf("%s (log2 bucket upper bound):\n", title);
+    for (int key = 0; key < NR_LAT_CLASSES; key++) {
+        const struct lat_hist *sum = &hists[key];
+        __u64 samples = 0;
+
+        for (int i = 0; i < NR_LAT_BUCKETS; i++)
+            samples += sum->buckets[i];
+
+        printf("  %s: p50 %.1f us, p99 %.1f us, p999 %.1f us (%llu samples)\n",
+               class_names[key],
+               hist_quantile(sum, 0.50) / 1000.0,
+               hist_quantile(sum, 0.99) / 1000.0,
+               hist_quantile(sum, 0.999) / 1000.0,
+               (unsigned long long)samples);
+
+        if (!dist)
+            continue;
+        for (int i = 0; i < NR_LAT_BUCKETS; i++) {
+            if (sum->buckets[i])
+                printf("    < %12.1f us: %llu\n", (double)(1ULL << (i + 1)) / 1000.0,
+                       (unsigned long long)sum->buckets[i]);
+        }
+    }
+}
+
+// Sum a per-CPU array of class histograms, like the probe's
+// rq_latency_hist, into hists
+static int read_percpu_hists(int hist_fd, struct lat_hist *hists)
+{
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct lat_hist *percpu;
+
+    if (nr_cpus <= 0) {
+        fprintf(stderr, "Failed to get possible CPU count\n");
+        return -1;
+    }
+
+    percpu = calloc(nr_cpus, sizeof(*percpu));
+    if (!percpu) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    memset(hists, 0, NR_LAT_CLASSES * sizeof(*hists));
+    for (__u32 key = 0; key < NR_LAT_CLASSES; key++) {
+        if (bpf_map_lookup_elem(hist_fd, &key, percpu))
+            continue;
+        for (int cpu = 0; cpu < nr_cpus; cpu++)
+            for (int i = 0; i < NR_LAT_BUCKETS; i++)
+                hists[key].buckets[i] += percpu[cpu].buckets[i];
+    }
+
+    free(percpu);
+    return 0;
+}
+
+// Programs in the latency probe object
+static const char *latency_progs[] = {
+    "handle_sched_wakeup",
+    "handle_sched_wakeup_new",
+    "handle_sched_switch",
+};
+
+#define NR_LATENCY_PROGS (sizeof(latency_progs) / sizeof(latency_progs[0]))
+
+// "loader latency": attach the tracepoint probe in latency.bpf.o for a
+// while, under whatever scheduler is active, and dump its runqueue
+// latency histograms. Tasks are split by the running scheduler's
+// priority_pids_map when its pins exist.
+static int run_latency(int argc, char **argv)
+{
+    struct option options[] = {
+        {"duration", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, NULL, 0}
+    };
+    struct bpf_link *links[NR_LATENCY_PROGS] = {};
+    struct lat_hist hists[NR_LAT_CLASSES];
+    struct bpf_object *obj;
+    struct bpf_map *map;
+    long duration = 10;
+    int opt, pids_fd, ret = 1;
+
+    while ((opt = getopt_long(argc, argv, "t:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            duration = atol(optarg);
+            if (duration <= 0) {
+                fprintf(stderr, "Error: duration must be positive\n");
+                return 1;
+            }
+            break;
+        case 'h':
+        default:
+            printf("Usage: loader latency [-t seconds] <latency_bpf_object>\n");
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Error: No latency BPF object file specified\n");
+        return 1;
+    }
+
+    if (bump_memlock_rlimit())
+        return 1;
+
+    obj = bpf_object__open(argv[optind]);
+    if (libbpf_get_error(obj)) {
+        fprintf(stderr, "Failed to open BPF object file: %s\n", argv[optind]);
+        return 1;
+    }
+
+    pids_fd = bpf_obj_get(PIN_DIR "/priority_pids_map");
+    map = bpf_object__find_map_by_name(obj, "priority_pids_map");
+    if (pids_fd < 0)
+        printf("No scheduler pins under %s, all tasks count as batch\n", PIN_DIR);
+    else if (!map)
+        fprintf(stderr, "Warning: %s has no priority_pids_map, all tasks count as batch\n",
+                argv[optind]);
+    else if (bpf_map__reuse_fd(map, pids_fd))
+        fprintf(stderr, "Warning: cannot share priority_pids_map, all tasks count as batch\n");
+    if (pids_fd >= 0)
+        close(pids_fd);
+
+    if (bpf_object__load(obj)) {
+        fprintf(stderr, "Failed to load BPF object: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < NR_LATENCY_PROGS; i++) {
+        struct bpf_program *prog = bpf_object__find_program_by_name(obj, latency_progs[i]);
+
+        links[i] = prog ? bpf_program__attach(prog) : NULL;
+        if (!links[i] || libbpf_get_error(links[i])) {
+            fprintf(stderr, "Failed to attach %s\n", latency_progs[i]);
+            links[i] = NULL;
+            goto cleanup;
+        }
+    }
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    printf("Tracing runqueue latency for %ld s, Ctrl-C to stop early\n", duration);
+    for (long t = 0; t < duration && !exiting; t++)
+        sleep(1);
+
+    map = bpf_object__find_map_by_name(obj, "rq_latency_hist");
+    if (!map) {
+        fprintf(stderr, "Error: Could not find rq_latency_hist\n");
+        goto cleanup;
+    }
+    if (read_percpu_hists(bpf_map__fd(map), hists))
+        goto cleanup;
+    print_latency(hists, "Runqueue latency", 1);
+    ret = 0;
+
+cleanup:
+    for (size_t i = 0; i < NR_LATENCY_PROGS; i++)
+        bpf_link__destroy(links[i]);
+    bpf_object__close(obj);
+    return ret;
+}
+
+struct trace_out {
+    FILE *f;
+    unsigned long long nr_events;
+};
+
+static int write_event(void *ctx, void *data, size_t size)
+{
+    struct trace_out *out = ctx;
+
+    if (size != sizeof(struct sched_event))
+        return 0;
+    if (fwrite(data, size, 1, out->f) != 1)
+        return -EIO;
+    out->nr_events++;
+    return 0;
+}
+
+// Drain the events ring buffer into path ('-' for stdout) as a raw
+// sequence of struct sched_event until SIGINT/SIGTERM
+static int drain_events(int events_fd, const char *path)
+{
+    struct trace_out out = {};
+    struct ring_buffer *rb;
+    int err = 0;
+
+    out.f = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    if (!out.f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    rb = ring_buffer__new(events_fd, write_event, &out, NULL);
+    if (!rb) {
+        fprintf(stderr, "Failed to open events ring buffer: %s\n", strerror(errno));
+        err = 1;
+        goto out;
+    }
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    fprintf(stderr, "Writing scheduler events to %s, Ctrl-C to stop\n", path);
+
+    while (!exiting) {
+        int n = ring_buffer__poll(rb, 100);
+
+        if (n == -EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "Failed to read events: %s\n", strerror(-n));
+            err = 1;
+            break;
+        }
+    }
+
+    ring_buffer__free(rb);
+    fprintf(stderr, "Wrote %llu events\n", out.nr_events);
+out:
+    if (out.f != stdout)
+        fclose(out.f);
+    else
+        fflush(stdout);
+    return err;
+}
+
+// On cgroup v2 a cgroup's ID is the inode number of its directory
+static int cgroup_id(const char *path, __u64 *id)
+{
+    struct stat st;
+
+    if (stat(path, &st)) {
+        fprintf(stderr, "Failed to stat cgroup %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not a cgroup directory\n", path);
+        return -1;
+    }
+    *id = st.st_ino;
+    return 0;
+}
+
+static const char *stat_names[NR_STATS] = {
+    [STAT_PRIORITY_ENQUEUED] = "Priority Enqueued",
+    [STAT_BATCH_ENQUEUED] = "Batch Enqueued",
+    [STAT_PRIORITY_DISPATCHED] = "Priority Dispatched",
+    [STAT_BATCH_DISPATCHED] = "Batch Dispatched",
+    [STAT_DIRECT_DISPATCHED] = "Direct Dispatched (idle CPU)",
+    [STAT_BATCH_PREEMPTED] = "Batch Preempted",
+    [STAT_LLC_STOLEN] = "Stolen From Remote LLC",
+    [STAT_PRIORITY_QUEUED] = "Priority Queued",
+    [STAT_BATCH_QUEUED] = "Batch Queued",
+    [STAT_IDLE_NS] = "Idle After Dispatch (ns)",
+    [STAT_TRACE_DROPPED] = "Trace Events Dropped",
+};
+
+// Gauges only make sense summed over CPUs, so they are not listed per CPU
+static int stat_is_gauge(int i)
+{
+    return i == STAT_PRIORITY_QUEUED || i == STAT_BATCH_QUEUED;
+}
+
+static double ratio(__u64 num, __u64 den)
+{
+    return den ? (double)num / den : 0.0;
+}
+
+// Print the queue_stats totals and latency histograms and, with per_cpu,
+// each CPU's share of the counters. Everything is read straight from the
+// mapped stripes, without a syscall per counter or CPU.
+static void print_stats(const volatile struct cpu_stats *stats, int per_cpu)
+{
+    int nr_cpus = libbpf_num_possible_cpus();
+    struct cpu_stats sum;
+    const __u64 *totals = sum.stats.counters;
+
+    if (nr_cpus <= 0) {
+        fprintf(stderr, "Failed to get possible CPU count\n");
+        return;
+    }
+    if (nr_cpus > MAX_CPUS)
+        nr_cpus = MAX_CPUS;
+
+    stats_sum(stats, nr_cpus, &sum);
+
+    printf("Queue Statistics:\n");
+    for (int i = 0; i < NR_STATS; i++) {
+        if (stat_is_gauge(i) || i == STAT_IDLE_NS)
+            continue;
+        printf("  %s: %llu\n", stat_names[i], (unsigned long long)totals[i]);
+    }
+
+    // Gauges were incremented and decremented on different CPUs, so only
+    // their wrapped sum is a count; a dequeue racing the read can make it
+    // briefly negative
+    printf("Derived:\n");
+    printf("  Priority Queue Depth: %lld\n", (long long)totals[STAT_PRIORITY_QUEUED]);
+    printf("  Batch Queue Depth: %lld\n", (long long)totals[STAT_BATCH_QUEUED]);
+    printf("  Priority Dispatch/Enqueue: %.3f\n",
+           ratio(totals[STAT_PRIORITY_DISPATCHED], totals[STAT_PRIORITY_ENQUEUED]));
+    printf("  Batch Dispatch/Enqueue: %.3f\n",
+           ratio(totals[STAT_BATCH_DISPATCHED], totals[STAT_BATCH_ENQUEUED]));
+    printf("  Idle After Dispatch: %.1f ms (%.1f ms per CPU)\n",
+           totals[STAT_IDLE_NS] / 1e6, totals[STAT_IDLE_NS] / 1e6 / nr_cpus);
+
+    if (per_cpu) {
+        // One row per CPU that counted anything, in sched_stats order
+        printf("Per-CPU Statistics (");
+        for (int i = 0, first = 1; i < NR_STATS; i++) {
+            if (stat_is_gauge(i))
+                continue;
+            printf("%s%s", first ? "" : ", ", stat_names[i]);
+            first = 0;
+        }
+        printf("):\n");
+
+        for (int cpu = 0; cpu < nr_cpus; cpu++) {
+            struct cpu_stats cs;
+            const __u64 *row = cs.stats.counters;
+            int busy = 0;
+
+            stats_read_cpu(stats, cpu, &cs);
+
+            for (int i = 0; i < NR_STATS; i++)
+                busy |= !stat_is_gauge(i) && row[i] != 0;
+            if (!busy)
+                continue;
+
+            printf("  CPU %3d:", cpu);
+            for (int i = 0; i < NR_STATS; i++) {
+                if (!stat_is_gauge(i))
+                    printf(" %12llu", (unsigned long long)row[i]);
+            }
+            printf("\n");
+        }
+    }
+
+    print_latency(sum.lat, "Enqueue-to-run latency", 0);
+}
+
+// Parse a priority level: a number from 0 to 255 or one of the named
+// levels. Returns -1 if it is neither.
+static int parse_level(const char *arg)
+{
+    static const struct {
+        const char *name;
+        int level;
+    } names[] = {
+        {"rt", LEVEL_RT},
+        {"interactive", LEVEL_INTERACTIVE},
+        {"default", LEVEL_DEFAULT},
+        {"batch", LEVEL_BATCH},
+        {"idle", LEVEL_IDLE},
+    };
+    char *end;
+    long level;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(arg, names[i].name) == 0)
+            return names[i].level;
+    }
+
+    level = strtol(arg, &end, 10);
+    if (end == arg || *end || level < 0 || level >= NR_LEVELS)
+        return -1;
+    return level;
+}
+
 static void print_usage(const char *prog)
 {
-    printf("Usage: %s [OPTIONS] <ebpf_object_file>\n", prog);
+    printf("Usage: %s --daemon [OPTIONS] <ebpf_object_file>\n", prog);
+    printf("       %s [OPTIONS]\n", prog);
+    printf("       %s latency [-t seconds] <latency_bpf_object>\n", prog);
+    printf("Without --daemon, options act on the running scheduler's maps pinned under %s\n",
+           PIN_DIR);
     printf("Options:\n");
-    printf("  -a, --add-pid <pid>       Add PID to priority queue\n");
+    printf("  -a, --add-pid <pid>       Add PID to priority queue (a process PID covers all its threads)\n");
     printf("  -r, --remove-pid <pid>    Remove PID from priority queue\n");
-    printf("  -l, --list-pids           List all PIDs in priority queue\n");
+    printf("  -L, --level <level>       With -a/-A, priority level 0-255 or rt, interactive,\n");
+    printf("                            default, batch, idle; lower runs first, %d and up\n",
+           LEVEL_DEFAULT);
+    printf("                            share the batch class (default interactive)\n");
+    printf("  -i, --inherit             With -a/-A, processes forked later inherit priority\n");
+    printf("  -A, --add-pids <file>     Add PIDs read from file ('-' for stdin) in bulk\n");
+    printf("  -D, --remove-pids <file>  Remove PIDs read from file ('-' for stdin) in bulk\n");
+    printf("  -g, --add-cgroup <path>   Give every task in a cgroup v2 subtree priority, always at\n");
+    printf("                            level interactive (-L and -i do not apply)\n");
+    printf("  -G, --remove-cgroup <path> Remove a cgroup added with --add-cgroup\n");
+    printf("  -l, --list-pids           List all PIDs and cgroups in priority queue\n");
     printf("  -s, --stats               Display queue statistics\n");
+    printf("  -c, --per-cpu             With -s, also break the statistics down per CPU\n");
+    printf("  -R, --batch-ratio <n>     Priority dispatches allowed per batch dispatch (default %d)\n",
+           DEFAULT_BATCH_RATIO);
+    printf("  -W, --max-batch-wait <ms> Longest a waiting batch queue may go unserved (default %llu)\n",
+           DEFAULT_MAX_BATCH_WAIT_NS / 1000000);
+    printf("  -N, --numa-imbalance <n>  Queued priority tasks before they leave their NUMA node (default %d)\n",
+           DEFAULT_NUMA_IMBALANCE);
+    printf("  -P, --priority-slice <us> Time slice for priority tasks (default %llu)\n",
+           DEFAULT_PRIORITY_SLICE_NS / 1000);
+    printf("  -B, --batch-slice <us>    Time slice for batch tasks (default %llu)\n",
+           DEFAULT_BATCH_SLICE_NS / 1000);
+    printf("  -S, --batch-stretch-slice <us>\n");
+    printf("                            Batch slice while no priority task waits (default %llu)\n",
+           DEFAULT_BATCH_STRETCH_SLICE_NS / 1000);
+    printf("  -E, --trace-sample <n>    Record 1 in n enqueue/dispatch/exit events, 0 stops (default 0)\n");
+    printf("  -T, --trace <file>        Write recorded events to file ('-' for stdout) until SIGINT\n");
+    printf("  -d, --daemon              Attach the scheduler and run until SIGINT/SIGTERM\n");
+    printf("  -M, --metrics <addr>      With --daemon, serve OpenMetrics on a Unix socket path\n");
+    printf("                            or a TCP port on 127.0.0.1\n");
     printf("  -h, --help                Show this help message\n");
 }
 
 int main(int argc, char **argv)
 {
-    struct bpf_object *obj;
-    struct bpf_map *priority_pids_map, *stats_map;
+    struct bpf_object *obj = NULL;
+    struct bpf_map *exit_map;
     const char *obj_file;
+    const char *add_file = NULL, *remove_file = NULL;
+    const char *add_cgroup = NULL, *remove_cgroup = NULL;
+    const char *trace_file = NULL, *metrics_addr = NULL;
+    int map_fd = -1, cgroup_fd = -1, stats_fd = -1, config_fd = -1, gen_fd = -1;
+    int trace_fd = -1, events_fd = -1;
     int ret = 0, option_index = 0;
-    int add_pid = -1, remove_pid = -1, list_pids = 0, show_stats = 0;
+    int add_pid = -1, remove_pid = -1, list_pids = 0, show_stats = 0, per_cpu = 0;
+    int daemon_mode = 0;
+    __u32 priority_val = LEVEL_INTERACTIVE;  // Level plus PRIO_FLAG_* flags
+    int level;
+    long batch_ratio = -1, max_batch_wait_ms = -1, numa_imbalance = -1;
+    long priority_slice_us = -1, batch_slice_us = -1, batch_stretch_slice_us = -1;
+    long trace_sample = -1;
     struct option options[] = {
         {"add-pid", required_argument, NULL, 'a'},
         {"remove-pid", required_argument, NULL, 'r'},
+        {"level", required_argument, NULL, 'L'},
+        {"inherit", no_argument, NULL, 'i'},
+        {"add-pids", required_argument, NULL, 'A'},
+        {"remove-pids", required_argument, NULL, 'D'},
+        {"add-cgroup", required_argument, NULL, 'g'},
+        {"remove-cgroup", required_argument, NULL, 'G'},
         {"list-pids", no_argument, NULL, 'l'},
         {"stats", no_argument, NULL, 's'},
+        {"per-cpu", no_argument, NULL, 'c'},
+        {"batch-ratio", required_argument, NULL, 'R'},
+        {"max-batch-wait", required_argument, NULL, 'W'},
+        {"numa-imbalance", required_argument, NULL, 'N'},
+        {"priority-slice", required_argument, NULL, 'P'},
+        {"batch-slice", required_argument, NULL, 'B'},
+        {"batch-stretch-slice", required_argument, NULL, 'S'},
+        {"trace-sample", required_argument, NULL, 'E'},
+        {"trace", required_argument, NULL, 'T'},
+        {"daemon", no_argument, NULL, 'd'},
+        {"metrics", required_argument, NULL, 'M'},
         {"help", no_argument, NULL, 'h'},
         {0, 0, NULL, 0}
     };
@@ -58,9 +1342,12 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (strcmp(argv[1], "latency") == 0)
+        return run_latency(argc - 1, argv + 1);
+
     // Parse options
     int opt;
-    while ((opt = getopt_long(argc, argv, "a:r:lsh", options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "a:r:L:iA:D:g:G:lscR:W:N:P:B:S:E:T:dM:h", options, &option_index)) != -1) {
         switch (opt) {
         case 'a':
             add_pid = atoi(optarg);
@@ -68,12 +1355,95 @@ int main(int argc, char **argv)
         case 'r':
             remove_pid = atoi(optarg);
             break;
+        case 'L':
+            level = parse_level(optarg);
+            if (level < 0) {
+                fprintf(stderr, "Error: invalid priority level: %s\n", optarg);
+                return 1;
+            }
+            priority_val = (priority_val & ~PRIO_LEVEL_MASK) | level;
+            break;
+        case 'i':
+            priority_val |= PRIO_FLAG_INHERIT;
+            break;
+        case 'A':
+            add_file = optarg;
+            break;
+        case 'D':
+            remove_file = optarg;
+            break;
+        case 'g':
+            add_cgroup = optarg;
+            break;
+        case 'G':
+            remove_cgroup = optarg;
+            break;
         case 'l':
             list_pids = 1;
             break;
         case 's':
             show_stats = 1;
             break;
+        case 'c':
+            per_cpu = 1;
+            break;
+        case 'R':
+            batch_ratio = atol(optarg);
+            if (batch_ratio <= 0) {
+                fprintf(stderr, "Error: batch ratio must be positive\n");
+                return 1;
+            }
+            break;
+        case 'W':
+            max_batch_wait_ms = atol(optarg);
+            if (max_batch_wait_ms <= 0) {
+                fprintf(stderr, "Error: max batch wait must be positive\n");
+                return 1;
+            }
+            break;
+        case 'N':
+            numa_imbalance = atol(optarg);
+            if (numa_imbalance <= 0) {
+                fprintf(stderr, "Error: NUMA imbalance must be positive\n");
+                return 1;
+            }
+            break;
+        case 'P':
+        case 'B':
+        case 'S': {
+            long us = atol(optarg);
+
+            if (us <= 0) {
+                fprintf(stderr, "Error: time slice must be positive\n");
+                return 1;
+            }
+            if (opt == 'P')
+                priority_slice_us = us;
+            else if (opt == 'B')
+                batch_slice_us = us;
+            else
+                batch_stretch_slice_us = us;
+            break;
+        }
+        case 'E': {
+            char *end;
+
+            trace_sample = strtol(optarg, &end, 10);
+            if (end == optarg || *end || trace_sample < 0 || trace_sample > UINT32_MAX) {
+                fprintf(stderr, "Error: invalid trace sample rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'M':
+            metrics_addr = optarg;
+            break;
         case 'h':
             print_usage(argv[0]);
             return 0;
@@ -83,70 +1453,164 @@ int main(int argc, char **argv)
         }
     }
 
-    if (optind >= argc) {
-        fprintf(stderr, "Error: No BPF object file specified\n");
-        print_usage(argv[0]);
+    // Cgroup entries hold only the classified root, not a level or flags
+    if (add_cgroup && priority_val != LEVEL_INTERACTIVE) {
+        fprintf(stderr, "Error: -L and -i apply to -a/-A only; cgroups always run at level interactive\n");
         return 1;
     }
 
-    obj_file = argv[optind];
-
-    // Check if file exists
-    if (access(obj_file, F_OK) != 0) {
-        fprintf(stderr, "Error: BPF object file not found: %s\n", obj_file);
+    if (metrics_addr && !daemon_mode) {
+        fprintf(stderr, "Error: --metrics is served by --daemon\n");
         return 1;
     }
 
-    // Increase RLIMIT_MEMLOCK
-    if (bump_memlock_rlimit()) {
+    if (daemon_mode && trace_file) {
+        fprintf(stderr, "Error: --trace reads from a running daemon, start it separately\n");
         return 1;
     }
 
-    // Load BPF object
-    printf("Loading BPF object: %s\n", obj_file);
-    obj = bpf_object__open(obj_file);
-    if (libbpf_get_error(obj)) {
-        fprintf(stderr, "Failed to open BPF object: %s\n", strerror(errno));
-        return 1;
-    }
+    if (daemon_mode) {
+        if (optind >= argc) {
+            fprintf(stderr, "Error: No BPF object file specified\n");
+            print_usage(argv[0]);
+            return 1;
+        }
 
-    // Load BPF programs
-    ret = bpf_object__load(obj);
-    if (ret) {
-        fprintf(stderr, "Failed to load BPF object: %s\n", strerror(errno));
-        goto cleanup;
-    }
+        obj_file = argv[optind];
 
-    printf("BPF object loaded successfully\n");
+        // Check if file exists
+        if (access(obj_file, F_OK) != 0) {
+            fprintf(stderr, "Error: BPF object file not found: %s\n", obj_file);
+            return 1;
+        }
 
-    // Get the priority_pids_map
-    priority_pids_map = bpf_object__find_map_by_name(obj, "priority_pids_map");
-    if (!priority_pids_map) {
-        fprintf(stderr, "Error: Could not find priority_pids_map\n");
-        ret = 1;
-        goto cleanup;
+        // Increase RLIMIT_MEMLOCK
+        if (bump_memlock_rlimit()) {
+            return 1;
+        }
+
+        // Load BPF object
+        printf("Loading BPF object: %s\n", obj_file);
+        obj = bpf_object__open(obj_file);
+        if (libbpf_get_error(obj)) {
+            fprintf(stderr, "Failed to open BPF object: %s\n", strerror(errno));
+            return 1;
+        }
+
+        // Load BPF programs
+        ret = bpf_object__load(obj);
+        if (ret) {
+            fprintf(stderr, "Failed to load BPF object: %s\n", strerror(errno));
+            goto cleanup;
+        }
+
+        printf("BPF object loaded successfully\n");
+
+        // Get the exit_info_map
+        exit_map = bpf_object__find_map_by_name(obj, "exit_info_map");
+        if (!exit_map) {
+            fprintf(stderr, "Error: Could not find exit_info_map\n");
+            ret = 1;
+            goto cleanup;
+        }
+
+        map_fd = find_map_fd(obj, "priority_pids_map");
+        cgroup_fd = find_map_fd(obj, "priority_cgroups_map");
+        stats_fd = find_map_fd(obj, "queue_stats");
+        config_fd = find_map_fd(obj, "sched_config_map");
+        gen_fd = find_map_fd(obj, "classify_gen_map");
+        if (trace_sample >= 0)
+            trace_fd = find_map_fd(obj, ".data.trace_ctl");
+
+        ret = load_topology(find_map_fd(obj, "cpu_llc_map"),
+                            find_map_fd(obj, "cpu_node_map"));
+        if (ret)
+            goto cleanup;
+    } else {
+        // Control commands talk to the running daemon through its pinned
+        // maps, so there is no object to load or verify
+        map_fd = open_pinned_map("priority_pids_map");
+        cgroup_fd = open_pinned_map("priority_cgroups_map");
+        stats_fd = open_pinned_map("queue_stats");
+        config_fd = open_pinned_map("sched_config_map");
+        gen_fd = open_pinned_map("classify_gen_map");
+        if (trace_sample >= 0)
+            trace_fd = open_pinned_map("trace_ctl");
+        if (trace_file)
+            events_fd = open_pinned_map("events");
     }
 
-    // Get the queue_stats map
-    stats_map = bpf_object__find_map_by_name(obj, "queue_stats");
-    if (!stats_map) {
-        fprintf(stderr, "Error: Could not find queue_stats map\n");
+    if (map_fd < 0 || cgroup_fd < 0 || stats_fd < 0 || config_fd < 0 || gen_fd < 0 ||
+        (trace_sample >= 0 && trace_fd < 0) || (trace_file && events_fd < 0)) {
         ret = 1;
         goto cleanup;
     }
 
-    int map_fd = bpf_map__fd(priority_pids_map);
-    int stats_fd = bpf_map__fd(stats_map);
+    // Handle the event sampling rate
+    if (trace_sample >= 0) {
+        __u32 zero = 0;
+        struct trace_ctl ctl = { .sample_rate = trace_sample };
+
+        ret = bpf_map_update_elem(trace_fd, &zero, &ctl, BPF_ANY);
+        if (ret) {
+            fprintf(stderr, "Failed to set trace sample rate: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        if (ctl.sample_rate)
+            printf("Tracing 1 in %u scheduler events\n", ctl.sample_rate);
+        else
+            printf("Event tracing off\n");
+    }
+
+    // Handle starvation guard, NUMA and time slice tunables
+    if (batch_ratio > 0 || max_batch_wait_ms > 0 || numa_imbalance > 0 ||
+        priority_slice_us > 0 || batch_slice_us > 0 || batch_stretch_slice_us > 0) {
+        __u32 zero = 0;
+        struct sched_config cfg = {};
+
+        // Keep whichever fields are not being changed
+        bpf_map_lookup_elem(config_fd, &zero, &cfg);
+        if (batch_ratio > 0)
+            cfg.batch_ratio = batch_ratio;
+        if (max_batch_wait_ms > 0)
+            cfg.max_batch_wait_ns = (__u64)max_batch_wait_ms * 1000000;
+        if (numa_imbalance > 0)
+            cfg.numa_imbalance = numa_imbalance;
+        if (priority_slice_us > 0)
+            cfg.priority_slice_ns = (__u64)priority_slice_us * 1000;
+        if (batch_slice_us > 0)
+            cfg.batch_slice_ns = (__u64)batch_slice_us * 1000;
+        if (batch_stretch_slice_us > 0)
+            cfg.batch_stretch_slice_ns = (__u64)batch_stretch_slice_us * 1000;
+
+        ret = bpf_map_update_elem(config_fd, &zero, &cfg, BPF_ANY);
+        if (ret) {
+            fprintf(stderr, "Failed to update scheduler config: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        printf("Starvation guard: batch ratio %u, max batch wait %llu ms\n",
+               cfg.batch_ratio ? cfg.batch_ratio : DEFAULT_BATCH_RATIO,
+               (cfg.max_batch_wait_ns ? cfg.max_batch_wait_ns : DEFAULT_MAX_BATCH_WAIT_NS) / 1000000);
+        printf("NUMA imbalance: %u queued priority tasks\n",
+               cfg.numa_imbalance ? cfg.numa_imbalance : DEFAULT_NUMA_IMBALANCE);
+        printf("Time slices: priority %llu us, batch %llu us, batch stretch %llu us\n",
+               (cfg.priority_slice_ns ? cfg.priority_slice_ns : DEFAULT_PRIORITY_SLICE_NS) / 1000,
+               (cfg.batch_slice_ns ? cfg.batch_slice_ns : DEFAULT_BATCH_SLICE_NS) / 1000,
+               (cfg.batch_stretch_slice_ns ? cfg.batch_stretch_slice_ns :
+                DEFAULT_BATCH_STRETCH_SLICE_NS) / 1000);
+    }
 
     // Handle add-pid operation
     if (add_pid > 0) {
-        __u32 priority_val = 1;  // Mark as priority task
         printf("Adding PID %d to priority queue\n", add_pid);
         ret = bpf_map_update_elem(map_fd, &add_pid, &priority_val, BPF_ANY);
         if (ret) {
             fprintf(stderr, "Failed to add PID to priority queue: %s\n", strerror(errno));
             goto cleanup;
         }
+        ret = bump_classify_gen(gen_fd);
+        if (ret)
+            goto cleanup;
         printf("Successfully added PID %d to priority queue\n", add_pid);
     }
 
@@ -158,55 +1622,156 @@ int main(int argc, char **argv)
             fprintf(stderr, "Failed to remove PID from priority queue: %s\n", strerror(errno));
             goto cleanup;
         }
+        ret = bump_classify_gen(gen_fd);
+        if (ret)
+            goto cleanup;
         printf("Successfully removed PID %d from priority queue\n", remove_pid);
     }
 
+    // Handle bulk add/remove operations
+    const char *bulk_files[] = {add_file, remove_file};
+    for (int remove = 0; remove < 2; remove++) {
+        __u32 *pids = NULL, n = 0, failed;
+
+        if (!bulk_files[remove])
+            continue;
+
+        if (read_pid_file(bulk_files[remove], &pids, &n)) {
+            ret = 1;
+            goto cleanup;
+        }
+
+        printf("%s %u PIDs %s priority queue\n", remove ? "Removing" : "Adding",
+               n, remove ? "from" : "to");
+        failed = bulk_update_pids(map_fd, pids, n, priority_val, remove);
+        free(pids);
+        // Publish whatever went through, even on partial failure
+        if (bump_classify_gen(gen_fd)) {
+            ret = 1;
+            goto cleanup;
+        }
+        if (failed) {
+            fprintf(stderr, "%u of %u PIDs failed\n", failed, n);
+            ret = 1;
+            goto cleanup;
+        }
+        printf("Successfully %s %u PIDs\n", remove ? "removed" : "added", n);
+    }
+
+    // Handle add-cgroup operation
+    if (add_cgroup) {
+        __u64 cgid;
+
+        if (cgroup_id(add_cgroup, &cgid)) {
+            ret = 1;
+            goto cleanup;
+        }
+        printf("Adding cgroup %s (id %llu) to priority queue\n", add_cgroup,
+               (unsigned long long)cgid);
+        // A directly classified cgroup maps to itself
+        ret = bpf_map_update_elem(cgroup_fd, &cgid, &cgid, BPF_ANY);
+        if (ret) {
+            fprintf(stderr, "Failed to add cgroup to priority queue: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        ret = bump_classify_gen(gen_fd);
+        if (ret)
+            goto cleanup;
+        printf("Successfully added cgroup %s to priority queue\n", add_cgroup);
+    }
+
+    // Handle remove-cgroup operation
+    if (remove_cgroup) {
+        __u64 cgid;
+
+        if (cgroup_id(remove_cgroup, &cgid)) {
+            ret = 1;
+            goto cleanup;
+        }
+        printf("Removing cgroup %s from priority queue\n", remove_cgroup);
+        ret = bpf_map_delete_elem(cgroup_fd, &cgid);
+        if (ret && errno != ENOENT) {
+            fprintf(stderr, "Failed to remove cgroup from priority queue: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        // Entries inherited from it are ignored once it is gone
+        ret = bump_classify_gen(gen_fd);
+        if (ret)
+            goto cleanup;
+        printf("Successfully removed cgroup %s from priority queue\n", remove_cgroup);
+    }
+
     // Handle list-pids operation
     if (list_pids) {
         printf("PIDs in priority queue:\n");
         __u32 pid = 0;
         __u32 next_pid;
-        __u32 priority_val;
+        __u32 val;
 
         while (bpf_map_get_next_key(map_fd, &pid, &next_pid) == 0) {
-            if (bpf_map_lookup_elem(map_fd, &next_pid, &priority_val) == 0) {
-                printf("  PID: %u (priority: %u)\n", next_pid, priority_val);
+            if (bpf_map_lookup_elem(map_fd, &next_pid, &val) == 0) {
+                printf("  PID: %u (level: %u%s)\n", next_pid, val & PRIO_LEVEL_MASK,
+                       val & PRIO_FLAG_INHERIT ? ", inherited by children" : "");
             }
             pid = next_pid;
         }
+
+        printf("Cgroups in priority queue:\n");
+        __u64 cgid, next_cgid, root;
+        void *prev_key = NULL;
+
+        while (bpf_map_get_next_key(cgroup_fd, prev_key, &next_cgid) == 0) {
+            if (bpf_map_lookup_elem(cgroup_fd, &next_cgid, &root) == 0) {
+                if (root == next_cgid)
+                    printf("  Cgroup ID: %llu\n", (unsigned long long)next_cgid);
+                else
+                    printf("  Cgroup ID: %llu (inherited from %llu)\n",
+                           (unsigned long long)next_cgid, (unsigned long long)root);
+            }
+            cgid = next_cgid;
+            prev_key = &cgid;
+        }
     }
 
     // Handle stats operation
     if (show_stats) {
-        printf("Queue Statistics:\n");
-        
-        // Define stat indices
-        #define STAT_PRIORITY_ENQUEUED  0
-        #define STAT_BATCH_ENQUEUED     1
-        #define STAT_PRIORITY_DISPATCHED 2
-        #define STAT_BATCH_DISPATCHED   3
-        
-        __u32 stat_keys[] = {STAT_PRIORITY_ENQUEUED, STAT_BATCH_ENQUEUED, 
-                             STAT_PRIORITY_DISPATCHED, STAT_BATCH_DISPATCHED};
-        const char *stat_names[] = {"Priority Enqueued", "Batch Enqueued", 
-                                    "Priority Dispatched", "Batch Dispatched"};
-        
-        for (int i = 0; i < 4; i++) {
-            __u64 stats[256];  // Max 256 CPUs
-            __u32 key = stat_keys[i];
-            
-            if (bpf_map_lookup_elem(stats_fd, &key, stats) == 0) {
-                // Sum across all CPUs
-                __u64 total = 0;
-                for (int cpu = 0; cpu < 256; cpu++) {
-                    total += stats[cpu];
-                }
-                printf("  %s: %llu\n", stat_names[i], total);
-            }
+        const volatile struct cpu_stats *stats = stats_mmap(stats_fd);
+
+        if (!stats) {
+            fprintf(stderr, "Failed to map queue statistics: %s\n", strerror(errno));
+            ret = 1;
+            goto cleanup;
         }
+        print_stats(stats, per_cpu);
+        stats_munmap(stats);
     }
 
+    // Handle trace operation, which runs until interrupted
+    if (trace_file)
+        ret = drain_events(events_fd, trace_file);
+
+    // Handle daemon mode last so the options above apply before attach
+    if (daemon_mode)
+        ret = run_daemon(obj, bpf_map__fd(exit_map), metrics_addr);
+
 cleanup:
-    bpf_object__close(obj);
+    if (obj) {
+        bpf_object__close(obj);
+    } else {
+        if (map_fd >= 0)
+            close(map_fd);
+        if (cgroup_fd >= 0)
+            close(cgroup_fd);
+        if (stats_fd >= 0)
+            close(stats_fd);
+        if (config_fd >= 0)
+            close(config_fd);
+        if (gen_fd >= 0)
+            close(gen_fd);
+        if (trace_fd >= 0)
+            close(trace_fd);
+        if (events_fd >= 0)
+            close(events_fd);
+    }
     return ret;
 }
@@ -1,9 +1,19 @@
 #include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include "scheduler.h"
+#include "bpf_util.h"
 
 char LICENSE[] SEC("license") = "GPL";
 
-// BPF Map: stores PIDs that should receive priority
+// sched_ext callbacks must be struct_ops programs
+#define BPF_STRUCT_OPS(name, args...) \
+    SEC("struct_ops/" #name) BPF_PROG(name, ##args)
+#define BPF_STRUCT_OPS_SLEEPABLE(name, args...) \
+    SEC("struct_ops.s/" #name) BPF_PROG(name, ##args)
+
+// BPF Map: stores PIDs that should receive priority. A process PID (TGID)
+// covers all threads of that process; a thread ID covers just that thread.
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __uint(max_entries, 10000);
@@ -11,65 +21,1129 @@ struct {
     __type(value, __u32);
 } priority_pids_map SEC(".maps");
 
-// Statistics map
+// BPF Map: cgroup IDs whose tasks should receive priority. The value is
+// the ID of the cgroup the loader classified: the key itself, or for
+// cgroups created later below it, that ancestor (see cgroup_init).
 struct {
-    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
-    __uint(max_entries, 4);
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 10000);
+    __type(key, __u64);
+    __type(value, __u64);
+} priority_cgroups_map SEC(".maps");
+
+// Bumped by the loader after every priority_pids_map or
+// priority_cgroups_map change, so cached task classes know when to look
+// the task up again
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
     __type(key, __u32);
     __type(value, __u64);
+} classify_gen_map SEC(".maps");
+
+// Per-task class cache, so enqueue() does not hash the PID every time
+struct task_ctx {
+    __u64 classify_gen;         // classify_gen_map value level was read at
+    __u64 runnable_at;          // when the task last started waiting, 0 if running
+    __u64 running_at;           // when the task last got a CPU
+    __u32 queued_llc;           // where the task is counted in level_nr_queued
+    __u16 queued_level;
+    __u8 level;
+    bool queued;
+    bool is_priority;           // LEVEL_IS_PRIORITY(level)
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_TASK_STORAGE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, int);
+    __type(value, struct task_ctx);
+} task_ctx_stor SEC(".maps");
+
+// Statistics and enqueue-to-run histograms, one cpu_stats stripe per
+// CPU, memory-mappable so readers need no syscalls
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CPUS);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __type(key, __u32);
+    __type(value, struct cpu_stats);
 } queue_stats SEC(".maps");
 
-#define STAT_PRIORITY_ENQUEUED  0
-#define STAT_BATCH_ENQUEUED     1
-#define STAT_PRIORITY_DISPATCHED 2
-#define STAT_BATCH_DISPATCHED   3
+// Runtime tunables written by the loader
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct sched_config);
+} sched_config_map SEC(".maps");
+
+// Per-CPU dispatch state
+struct cpu_ctx {
+    __u32 priority_streak;      // priority dispatches since the last batch one
+    __u32 running_batch;        // 1 while this CPU is in its LLC's batch_cpus mask
+    __u64 idle_since;           // when dispatch() last left this CPU idle, 0 if busy
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct cpu_ctx);
+} cpu_ctx_map SEC(".maps");
+
+// Why the scheduler was unloaded, read by the loader on shutdown
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct exit_record);
+} exit_info_map SEC(".maps");
+
+// Sampled scheduling events, drained by "loader -T"
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, EVENTS_RINGBUF_SIZE);
+} events SEC(".maps");
+
+// Event sampling rate, written by "loader -E". A global in a section of
+// its own rather than a map entry, so the check on every hot path is a
+// single load and branch and the loader can rewrite it without touching
+// other globals.
+struct trace_ctl trace_ctl SEC(".data.trace_ctl");
+
+// CPU -> last-level cache index, filled in by the loader before attach
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CPUS);
+    __type(key, __u32);
+    __type(value, __u32);
+} cpu_llc_map SEC(".maps");
+
+// CPU -> NUMA node, filled in by the loader before attach
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CPUS);
+    __type(key, __u32);
+    __type(value, __u32);
+} cpu_node_map SEC(".maps");
+
+// A cpumask kptr per LLC, node or CPU, created at init
+struct cpumask_slot {
+    struct bpf_cpumask __kptr *mask;
+};
+
+// CPUs of each LLC running a batch task that priority work may preempt.
+// Set in running(), cleared in stopping() or when a waker claims the CPU.
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_LLCS);
+    __type(key, __u32);
+    __type(value, struct cpumask_slot);
+} batch_cpus SEC(".maps");
+
+// CPUs of each NUMA node, built at init from cpu_node_map
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_NODES);
+    __type(key, __u32);
+    __type(value, struct cpumask_slot);
+} node_cpus SEC(".maps");
+
+// Scratch mask per CPU for intersecting masks in select_cpu(), which runs
+// with preemption off
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, MAX_CPUS);
+    __type(key, __u32);
+    __type(value, struct cpumask_slot);
+} scratch_cpus SEC(".maps");
+
+// Number of LLCs in cpu_llc_map and the node of each, computed at init
+__u32 nr_llcs = 1;
+__u32 llc_node[MAX_LLCS];
+
+// Last time each LLC's batch levels were served or found empty
+__u64 last_batch_dispatch_ns[MAX_LLCS];
+
+// Batch class virtual time: the vtime of the most recently started batch
+// task. Batch level DSQs are ordered by vtime rather than FIFO.
+__u64 vtime_now;
+
+// Custom dispatch queues, one per LLC and level. Lower levels are always
+// drained first, apart from the batch starvation guard.
+#define LEVEL_DSQ(llc, level) ((__u64)(llc) * NR_LEVELS + (level))
+
+// Tasks enqueued on each level DSQ and not yet running, and a bitmap of
+// the levels where that count is non-zero, so dispatch finds the most
+// urgent queue with a find-first-set instead of probing 256 DSQs.
+// The bitmap is a hint: a counted task may still be on its way into the
+// DSQ, or may already have been consumed by another CPU.
+#define NR_LEVEL_WORDS (NR_LEVELS / 64)
+
+__u32 level_nr_queued[MAX_LLCS][NR_LEVELS];
+__u64 level_mask[MAX_LLCS][NR_LEVEL_WORDS];
+
+#define ENOENT 2
+#define ENOMEM 12
+
+static __u32 cpu_llc(s32 cpu)
+{
+    __u32 key = cpu;
+    __u32 *llc = bpf_map_lookup_elem(&cpu_llc_map, &key);
+
+    return llc && *llc < MAX_LLCS ? *llc : 0;
+}
+
+static __u32 cpu_node(s32 cpu)
+{
+    __u32 key = cpu;
+    __u32 *node = bpf_map_lookup_elem(&cpu_node_map, &key);
+
+    return node && *node < MAX_NODES ? *node : 0;
+}
+
+static __u64 current_classify_gen(void)
+{
+    __u32 zero = 0;
+    __u64 *gen = bpf_map_lookup_elem(&classify_gen_map, &zero);
+
+    return gen ? *gen : 0;
+}
+
+// Deepest cgroup ancestor walk, to keep the loop verifiable
+#define MAX_CGROUP_DEPTH 16
+
+// Whether a cgroup ID is classified, either directly or by inheriting
+// from an ancestor that is still classified
+static bool cgroup_id_is_priority(__u64 cgid)
+{
+    __u64 *root = bpf_map_lookup_elem(&priority_cgroups_map, &cgid);
+
+    if (!root)
+        return false;
+    return *root == cgid || bpf_map_lookup_elem(&priority_cgroups_map, root) != NULL;
+}
+
+// Whether a cgroup or any of its ancestors is classified. Descendants that
+// existed before their ancestor was classified have no entry of their
+// own, so walk up from the nearest ancestor.
+static bool cgroup_is_priority(struct cgroup *cgrp)
+{
+    int level = cgrp->level;
+
+    if (cgroup_id_is_priority(cgrp->kn->id))
+        return true;
+
+    for (int i = 1; i <= MAX_CGROUP_DEPTH && i <= level; i++) {
+        struct cgroup *anc = bpf_cgroup_ancestor(cgrp, level - i);
+        bool found;
+
+        if (!anc)
+            break;
+        found = cgroup_id_is_priority(anc->kn->id);
+        bpf_cgroup_release(anc);
+        if (found)
+            return true;
+    }
+    return false;
+}
+
+// Look the task's level up by TID, TGID and cgroup and cache
+// the answer in tctx. cgrp is the task's cgroup if the caller has it, or
+// NULL to look it up. Classified cgroups put their tasks at
+// LEVEL_INTERACTIVE, everything unclassified runs at LEVEL_DEFAULT.
+// The generation is read first, so an update that races with the lookup
+// leaves a stale generation behind and forces another lookup later.
+static __u32 refresh_task_class(struct task_struct *p, struct task_ctx *tctx,
+                                struct cgroup *cgrp)
+{
+    __u64 gen = current_classify_gen();
+    __u32 pid = p->pid, tgid = p->tgid;
+    __u32 level = LEVEL_DEFAULT;
+    __u32 *val = bpf_map_lookup_elem(&priority_pids_map, &pid);
+
+    // A process's PID is its main thread's TID and every thread's TGID, so
+    // adding it covers all of its threads, including ones created later
+    if (!val && tgid != pid)
+        val = bpf_map_lookup_elem(&priority_pids_map, &tgid);
+
+    if (val) {
+        level = *val & PRIO_LEVEL_MASK;
+    } else if (cgrp) {
+        if (cgroup_is_priority(cgrp))
+            level = LEVEL_INTERACTIVE;
+    } else {
+        cgrp = scx_bpf_task_cgroup(p);
+        if (cgrp) {
+            if (cgroup_is_priority(cgrp))
+                level = LEVEL_INTERACTIVE;
+            bpf_cgroup_release(cgrp);
+        }
+    }
+
+    if (tctx) {
+        tctx->level = level;
+        tctx->is_priority = LEVEL_IS_PRIORITY(level);
+        tctx->classify_gen = gen;
+    }
+    return level;
+}
+
+// Return the task's level, hitting the PID hash only when the cached
+// level predates the last priority_pids_map change
+static __u32 task_level(struct task_struct *p)
+{
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+
+    if (tctx && tctx->classify_gen == current_classify_gen())
+        return tctx->level;
+    return refresh_task_class(p, tctx, NULL);
+}
+
+// This CPU's queue_stats stripe
+static struct cpu_stats *this_cpu_stats(void)
+{
+    __u32 cpu = bpf_get_smp_processor_id();
+
+    return bpf_map_lookup_elem(&queue_stats, &cpu);
+}
+
+// The stripe belongs to this CPU and callbacks run with preemption off,
+// so a plain add is enough; an atomic add would only buy a locked
+// instruction. Gauges pass -1 as delta.
+static void stat_add(__u32 idx, __u64 delta)
+{
+    struct cpu_stats *cs = this_cpu_stats();
+
+    if (cs && idx < NR_STATS)
+        cs->stats.counters[idx] += delta;
+}
+
+static void stat_inc(__u32 idx)
+{
+    stat_add(idx, 1);
+}
+
+// Index of the lowest set bit; v must be non-zero
+static __u32 ctz_u64(__u64 v)
+{
+    return log2_u64(v & -v);
+}
+
+// Count a task into or out of a level DSQ and keep level_mask in step.
+// Whoever drops a count to zero clears the bit and then looks at the
+// count again, while whoever raises it sets the bit after counting, so a
+// racing enqueue can never be left with its bit cleared. A count already
+// reset by level_reset() is not taken below zero.
+static void level_account(__u32 llc, __u32 level, bool add)
+{
+    __u64 bit = 1ULL << (level & 63);
+    __u32 *nr, old = 0;
+    bool dropped = false;
+    __u64 *word;
+
+    if (llc >= MAX_LLCS || level >= NR_LEVELS)
+        return;
+    word = &level_mask[llc][level / 64];
+    nr = &level_nr_queued[llc][level];
+
+    if (add) {
+        stat_add(LEVEL_IS_PRIORITY(level) ? STAT_PRIORITY_QUEUED : STAT_BATCH_QUEUED, 1);
+        __sync_fetch_and_add(nr, 1);
+        __sync_fetch_and_or(word, bit);
+        return;
+    }
+
+    for (int i = 0; i < 8 && !dropped; i++) {
+        old = *nr;
+        if (!old)
+            return;
+        dropped = __sync_val_compare_and_swap(nr, old, old - 1) == old;
+    }
+    if (!dropped)
+        return;
+    stat_add(LEVEL_IS_PRIORITY(level) ? STAT_PRIORITY_QUEUED : STAT_BATCH_QUEUED, -1);
+
+    if (old == 1) {
+        __sync_fetch_and_and(word, ~bit);
+        if (*nr)
+            __sync_fetch_and_or(word, bit);
+    }
+}
+
+// Forget the tasks counted on a level DSQ that turned out empty. Tasks
+// left on the count this way already ran or left sched_ext; the count
+// must not move meanwhile, and the bit is restored if the DSQ has filled
+// again by the time it is cleared.
+static void level_reset(__u32 llc, __u32 level)
+{
+    __u64 bit = 1ULL << (level & 63);
+    __u32 *nr, seen;
+    __u64 *word;
+
+    if (llc >= MAX_LLCS || level >= NR_LEVELS)
+        return;
+    word = &level_mask[llc][level / 64];
+    nr = &level_nr_queued[llc][level];
+
+    seen = *nr;
+    if (!seen || scx_bpf_dsq_nr_queued(LEVEL_DSQ(llc, level)) > 0 ||
+        __sync_val_compare_and_swap(nr, seen, 0) != seen)
+        return;
+    stat_add(LEVEL_IS_PRIORITY(level) ? STAT_PRIORITY_QUEUED : STAT_BATCH_QUEUED, -(__u64)seen);
+
+    __sync_fetch_and_and(word, ~bit);
+    if (*nr || scx_bpf_dsq_nr_queued(LEVEL_DSQ(llc, level)) > 0)
+        __sync_fetch_and_or(word, bit);
+}
+
+// Drop the task's count from the level DSQ it was enqueued on, once it
+// has left it
+static void level_unqueue(struct task_ctx *tctx)
+{
+    if (!tctx->queued)
+        return;
+    tctx->queued = false;
+    level_account(tctx->queued_llc, tctx->queued_level, false);
+}
+
+// Most urgent level at or after from with tasks queued in the LLC, or
+// NR_LEVELS if there is none
+static __u32 first_ready_level(__u32 llc, __u32 from)
+{
+    if (llc >= MAX_LLCS)
+        return NR_LEVELS;
+
+    for (__u32 w = from / 64; w < NR_LEVEL_WORDS; w++) {
+        __u64 word = level_mask[llc][w];
+
+        if (w == from / 64)
+            word &= ~0ULL << (from & 63);
+        if (word)
+            return w * 64 + ctz_u64(word);
+    }
+    return NR_LEVELS;
+}
+
+static __u32 level_queued(__u32 llc, __u32 level)
+{
+    if (llc >= MAX_LLCS || level >= NR_LEVELS)
+        return 0;
+    return level_nr_queued[llc][level];
+}
+
+// Record one event, 1 in sample_rate of the calls. dsq is a level DSQ in
+// llc, whose depth is reported, or a built-in DSQ. cpu is where the task
+// was sent, or -1 for the CPU running the callback.
+static void emit_event(__u8 type, struct task_struct *p, __u32 level,
+                       __u64 dsq, __u32 llc, s32 cpu, __u32 sample_rate)
+{
+    struct sched_event *ev;
+
+    if (sample_rate > 1 && bpf_get_prandom_u32() % sample_rate)
+        return;
+
+    ev = bpf_ringbuf_reserve(&events, sizeof(*ev), 0);
+    if (!ev) {
+        stat_inc(STAT_TRACE_DROPPED);
+        return;
+    }
+    ev->ts = bpf_ktime_get_ns();
+    ev->dsq = dsq;
+    ev->pid = p->pid;
+    ev->depth = dsq & SCX_DSQ_FLAG_BUILTIN ? 0 : level_queued(llc, level);
+    ev->cpu = cpu >= 0 ? cpu : bpf_get_smp_processor_id();
+    ev->type = type;
+    ev->level = level;
+    ev->__pad = 0;
+    bpf_ringbuf_submit(ev, 0);
+}
+
+// Inlined into every caller so that with tracing off all it costs is
+// the load and branch on the sample rate
+static __always_inline void trace_event(__u8 type, struct task_struct *p, __u32 level,
+                                        __u64 dsq, __u32 llc, s32 cpu)
+{
+    __u32 sample_rate = trace_ctl.sample_rate;
+
+    if (sample_rate)
+        emit_event(type, p, level, dsq, llc, cpu, sample_rate);
+}
+
+// Bound on stale level_mask bits skipped per dispatch
+#define MAX_CONSUME_TRIES 8
+
+// Consume one task from the most urgent ready level in [from, to) of the
+// LLC. A level whose DSQ turns out empty is reset, so a stale count
+// cannot keep hiding the levels behind it.
+static bool consume_levels(__u32 llc, __u32 from, __u32 to)
+{
+    for (int i = 0; i < MAX_CONSUME_TRIES; i++) {
+        __u32 level = first_ready_level(llc, from);
+
+        if (level >= to)
+            return false;
+        if (scx_bpf_consume(LEVEL_DSQ(llc, level)))
+            return true;
+        level_reset(llc, level);
+        from = level + 1;
+    }
+    return false;
+}
+
+// Snapshot sched_config_map, substituting defaults for unset fields
+static void read_config(struct sched_config *cfg)
+{
+    __u32 zero = 0;
+    struct sched_config *c = bpf_map_lookup_elem(&sched_config_map, &zero);
+
+    cfg->batch_ratio = c && c->batch_ratio ? c->batch_ratio : DEFAULT_BATCH_RATIO;
+    cfg->numa_imbalance = c && c->numa_imbalance ? c->numa_imbalance : DEFAULT_NUMA_IMBALANCE;
+    cfg->max_batch_wait_ns = c && c->max_batch_wait_ns ?
+        c->max_batch_wait_ns : DEFAULT_MAX_BATCH_WAIT_NS;
+    cfg->priority_slice_ns = c && c->priority_slice_ns ?
+        c->priority_slice_ns : DEFAULT_PRIORITY_SLICE_NS;
+    cfg->batch_slice_ns = c && c->batch_slice_ns ?
+        c->batch_slice_ns : DEFAULT_BATCH_SLICE_NS;
+    cfg->batch_stretch_slice_ns = c && c->batch_stretch_slice_ns ?
+        c->batch_stretch_slice_ns : DEFAULT_BATCH_STRETCH_SLICE_NS;
+}
+
+// Slice for a task of the given class. Batch work gets the longer
+// stretch slice while no priority task is waiting; a priority task that
+// shows up later preempts it anyway.
+static __u64 task_slice(bool is_priority, __u32 llc)
+{
+    struct sched_config cfg;
+
+    read_config(&cfg);
+    if (is_priority)
+        return cfg.priority_slice_ns;
+    if (first_ready_level(llc, 0) >= LEVEL_DEFAULT)
+        return cfg.batch_stretch_slice_ns;
+    return cfg.batch_slice_ns;
+}
+
+// bpf_loop callback for init: create the level DSQ whose ID is idx on
+// the LLC's NUMA node. 256 DSQs per LLC is too many for an unrolled loop.
+static long create_level_dsq(__u32 idx, void *data)
+{
+    __u32 llc = idx / NR_LEVELS;
+    s32 *ret = data;
+
+    *ret = scx_bpf_create_dsq(idx, llc < MAX_LLCS ? llc_node[llc] : -1);
+    return *ret ? 1 : 0;
+}
+
+// Store a new empty cpumask in slot idx of a cpumask_slot map
+static s32 create_cpumask(void *map, __u32 idx)
+{
+    struct cpumask_slot *slot = bpf_map_lookup_elem(map, &idx);
+    struct bpf_cpumask *mask;
+
+    if (!slot)
+        return -ENOENT;
+    mask = bpf_cpumask_create();
+    if (!mask)
+        return -ENOMEM;
+    mask = bpf_kptr_xchg(&slot->mask, mask);
+    if (mask)
+        bpf_cpumask_release(mask);
+    return 0;
+}
+
+// Give a CPU its scratch mask and add it to its node's mask
+static long init_cpu_masks(__u32 cpu, void *data)
+{
+    struct cpumask_slot *slot;
+    struct bpf_cpumask *mask;
+    __u32 node = cpu_node(cpu);
+    s32 *ret = data;
+
+    *ret = create_cpumask(&scratch_cpus, cpu);
+    if (*ret)
+        return 1;
+
+    bpf_rcu_read_lock();
+    slot = bpf_map_lookup_elem(&node_cpus, &node);
+    mask = slot ? slot->mask : NULL;
+    if (mask)
+        bpf_cpumask_set_cpu(cpu, mask);
+    bpf_rcu_read_unlock();
+    return 0;
+}
+
+// Init hook - size the topology and create the per-LLC level dispatch
+// queues and cpumasks before any task is enqueued
+s32 BPF_STRUCT_OPS_SLEEPABLE(init)
+{
+    __u32 nr_cpus = scx_bpf_nr_cpu_ids();
+    __u32 max_llc = 0;
+    s32 ret = 0;
+
+    for (__u32 cpu = 0; cpu < MAX_CPUS && cpu < nr_cpus; cpu++) {
+        __u32 llc = cpu_llc(cpu);
+
+        if (llc > max_llc)
+            max_llc = llc;
+        if (llc < MAX_LLCS)
+            llc_node[llc] = cpu_node(cpu);
+    }
+    nr_llcs = max_llc + 1;
+
+    for (__u32 llc = 0; llc < MAX_LLCS && llc < nr_llcs; llc++) {
+        ret = create_cpumask(&batch_cpus, llc);
+        if (ret)
+            return ret;
+    }
+    for (__u32 node = 0; node < MAX_NODES; node++) {
+        ret = create_cpumask(&node_cpus, node);
+        if (ret)
+            return ret;
+    }
+    bpf_loop(nr_cpus < MAX_CPUS ? nr_cpus : MAX_CPUS, init_cpu_masks, &ret, 0);
+    if (ret)
+        return ret;
+
+    bpf_loop(nr_llcs * NR_LEVELS, create_level_dsq, &ret, 0);
+    return ret;
+}
+
+// Copy the parent's priority_pids_map entry to a newly forked process if
+// the entry asks for it. The copy keeps the inherit flag, so the whole
+// process tree below the classified process follows without a userspace
+// round trip; exit_task drops the copy again. New threads need nothing,
+// as they are covered by their TGID.
+// init_task runs from sched_cgroup_fork(), before copy_process() sets
+// p->real_parent; that still holds the forking task's own parent. The
+// forking task is the current one.
+static void inherit_class(struct task_struct *p)
+{
+    struct task_struct *parent = bpf_get_current_task_btf();
+    __u32 pid = p->pid, ppid;
+    __u32 *val;
+
+    if (pid != p->tgid)
+        return;
+
+    ppid = parent->pid;
+    val = bpf_map_lookup_elem(&priority_pids_map, &ppid);
+    if (!val) {
+        ppid = parent->tgid;
+        val = bpf_map_lookup_elem(&priority_pids_map, &ppid);
+    }
+
+    if (val && (*val & PRIO_FLAG_INHERIT))
+        bpf_map_update_elem(&priority_pids_map, &pid, val, BPF_NOEXIST);
+}
+
+// Init task hook - allocate the class cache and classify the task once
+s32 BPF_STRUCT_OPS(init_task, struct task_struct *p, struct scx_init_task_args *args)
+{
+    struct task_ctx *tctx;
+
+    tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, BPF_LOCAL_STORAGE_GET_F_CREATE);
+    if (!tctx)
+        return -ENOMEM;
+
+    if (args->fork)
+        inherit_class(p);
+
+    refresh_task_class(p, tctx, args->cgroup);
+    return 0;
+}
+
+// Cgroup init hook - a cgroup created below a classified one gets its own
+// entry pointing at that ancestor, so its tasks resolve in one lookup.
+// If the ancestor is later removed, the entry is ignored.
+s32 BPF_STRUCT_OPS(cgroup_init, struct cgroup *cgrp, struct scx_cgroup_init_args *args)
+{
+    struct cgroup *parent;
+    __u64 cgid, parent_id, *root;
+
+    if (cgrp->level <= 0)
+        return 0;
+
+    parent = bpf_cgroup_ancestor(cgrp, cgrp->level - 1);
+    if (!parent)
+        return 0;
+    parent_id = parent->kn->id;
+    bpf_cgroup_release(parent);
+
+    root = bpf_map_lookup_elem(&priority_cgroups_map, &parent_id);
+    if (root && cgroup_id_is_priority(parent_id)) {
+        cgid = cgrp->kn->id;
+        bpf_map_update_elem(&priority_cgroups_map, &cgid, root, BPF_NOEXIST);
+    }
+    return 0;
+}
+
+// Cgroup exit hook - cgroup IDs are never reused, so drop the entry
+void BPF_STRUCT_OPS(cgroup_exit, struct cgroup *cgrp)
+{
+    __u64 cgid = cgrp->kn->id;
+
+    bpf_map_delete_elem(&priority_cgroups_map, &cgid);
+}
+
+// Cgroup move hook - the task may have changed class
+void BPF_STRUCT_OPS(cgroup_move, struct task_struct *p, struct cgroup *from,
+                    struct cgroup *to)
+{
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+
+    if (tctx)
+        refresh_task_class(p, tctx, to);
+}
+
+// The LLC's batch_cpus mask; call under bpf_rcu_read_lock()
+static struct bpf_cpumask *llc_batch_cpus(__u32 llc)
+{
+    struct cpumask_slot *slot = bpf_map_lookup_elem(&batch_cpus, &llc);
+
+    return slot ? slot->mask : NULL;
+}
+
+// Add or remove this CPU from its LLC's batch_cpus, if not there already
+static void set_batch_cpu(struct cpu_ctx *cctx, bool batch)
+{
+    s32 cpu = bpf_get_smp_processor_id();
+    struct bpf_cpumask *mask;
+
+    if (cctx->running_batch == batch)
+        return;
+    cctx->running_batch = batch;
+
+    bpf_rcu_read_lock();
+    mask = llc_batch_cpus(cpu_llc(cpu));
+    if (mask) {
+        if (batch)
+            bpf_cpumask_set_cpu(cpu, mask);
+        else
+            bpf_cpumask_clear_cpu(cpu, mask);
+    }
+    bpf_rcu_read_unlock();
+}
+
+// Attempts before giving up when racing wakers claim the picked CPUs
+#define MAX_PREEMPT_TRIES 4
+
+// Kick one CPU in the given LLC that is running a batch task the
+// priority task may use; only those CPUs drain the LLC's priority levels
+// first. A CPU is claimed by clearing its batch_cpus bit, so concurrent
+// priority wakeups never kick the same CPU twice.
+static void preempt_batch_cpu(struct task_struct *p, __u32 llc)
+{
+    __u32 nr_cpus = scx_bpf_nr_cpu_ids();
+    struct bpf_cpumask *mask;
+
+    bpf_rcu_read_lock();
+    mask = llc_batch_cpus(llc);
+    if (!mask)
+        goto out;
+
+    for (int i = 0; i < MAX_PREEMPT_TRIES; i++) {
+        __u32 cpu = bpf_cpumask_any_and_distribute((const struct cpumask *)mask, p->cpus_ptr);
+
+        if (cpu >= nr_cpus)
+            break;
+        if (bpf_cpumask_test_and_clear_cpu(cpu, mask)) {
+            scx_bpf_kick_cpu(cpu, SCX_KICK_PREEMPT);
+            stat_inc(STAT_BATCH_PREEMPTED);
+            break;
+        }
+    }
+out:
+    bpf_rcu_read_unlock();
+}
+
+// Claim an idle CPU on the given NUMA node that the task may use, in
+// the order scx_bpf_select_cpu_dfl() uses within a domain: prev_cpu if
+// its whole core is idle, then any fully idle core, then prev_cpu, then
+// any idle CPU; -1 if there is none
+static s32 pick_idle_cpu_on_node(struct task_struct *p, s32 prev_cpu, __u32 node)
+{
+    struct cpumask_slot *node_slot, *scratch_slot;
+    struct bpf_cpumask *node_mask, *scratch;
+    const struct cpumask *smt, *allowed;
+    __u32 this_cpu = bpf_get_smp_processor_id();
+    bool prev_ok = cpu_node(prev_cpu) == node &&
+                   bpf_cpumask_test_cpu(prev_cpu, p->cpus_ptr);
+    s32 cpu = -1;
+
+    if (prev_ok) {
+        bool core_idle;
+
+        smt = scx_bpf_get_idle_smtmask();
+        core_idle = bpf_cpumask_test_cpu(prev_cpu, smt);
+        scx_bpf_put_idle_cpumask(smt);
+        if (core_idle && scx_bpf_test_and_clear_cpu_idle(prev_cpu))
+            return prev_cpu;
+    }
+
+    bpf_rcu_read_lock();
+    node_slot = bpf_map_lookup_elem(&node_cpus, &node);
+    scratch_slot = bpf_map_lookup_elem(&scratch_cpus, &this_cpu);
+    node_mask = node_slot ? node_slot->mask : NULL;
+    scratch = scratch_slot ? scratch_slot->mask : NULL;
+    if (!node_mask || !scratch)
+        goto out;
+
+    bpf_cpumask_and(scratch, (const struct cpumask *)node_mask, p->cpus_ptr);
+    allowed = (const struct cpumask *)scratch;
+
+    cpu = scx_bpf_pick_idle_cpu(allowed, SCX_PICK_IDLE_CORE);
+    if (cpu >= 0)
+        goto out;
+    if (prev_ok && scx_bpf_test_and_clear_cpu_idle(prev_cpu)) {
+        cpu = prev_cpu;
+        goto out;
+    }
+    cpu = scx_bpf_pick_idle_cpu(allowed, 0);
+out:
+    bpf_rcu_read_unlock();
+    return cpu;
+}
+
+// Select CPU hook - pick a CPU for a waking task. Priority tasks stay on
+// the NUMA node of their previous CPU unless their level's queue in their
+// LLC is past the configured imbalance; everything else uses the default
+// picker, which prefers the previous CPU, then an idle SMT sibling or LLC
+// peer. If the chosen CPU is idle, nothing can be queued ahead of the
+// task, so dispatch straight to that CPU's local DSQ and skip enqueue().
+s32 BPF_STRUCT_OPS(select_cpu, struct task_struct *p, s32 prev_cpu, u64 wake_flags)
+{
+    struct sched_config cfg;
+    __u32 level = task_level(p);
+    bool is_priority = LEVEL_IS_PRIORITY(level);
+    bool is_idle = false;
+    s32 cpu = -1;
+
+    if (is_priority) {
+        cpu = pick_idle_cpu_on_node(p, prev_cpu, cpu_node(prev_cpu));
+        is_idle = cpu >= 0;
+
+        // The home node is busy: only look further afield once enough
+        // priority work has piled up that remote memory is the lesser cost
+        read_config(&cfg);
+        if (!is_idle &&
+            level_queued(cpu_llc(prev_cpu), level) < cfg.numa_imbalance)
+            return prev_cpu;
+    }
+
+    if (!is_idle)
+        cpu = scx_bpf_select_cpu_dfl(p, prev_cpu, wake_flags, &is_idle);
+
+    if (is_idle) {
+        stat_inc(STAT_DIRECT_DISPATCHED);
+        scx_bpf_dispatch(p, SCX_DSQ_LOCAL, task_slice(is_priority, cpu_llc(cpu)), 0);
+        trace_event(SCHED_EV_DISPATCH, p, level, SCX_DSQ_LOCAL, 0, cpu);
+    }
+
+    return cpu;
+}
+
+static bool vtime_before(__u64 a, __u64 b)
+{
+    return (s64)(a - b) < 0;
+}
 
 // Enqueue hook - called when task becomes runnable
-void enqueue(struct task_struct *p, u64 enq_flags)
+void BPF_STRUCT_OPS(enqueue, struct task_struct *p, u64 enq_flags)
 {
-    __u32 pid = p->pid;
     __u32 key = 0;
-    __u64 *stat_ptr;
+    struct task_ctx *tctx;
+    struct sched_config cfg;
+    bool is_priority;
+    __u64 vtime;
+    __u32 llc, level;
     
-    // Check if this PID should have priority
-    if (bpf_map_lookup_elem(&priority_pids_map, &pid)) {
-        key = STAT_PRIORITY_ENQUEUED;
-    } else {
-        key = STAT_BATCH_ENQUEUED;
-    }
+    // Tasks requeued after their slice ran out skip runnable(), so
+    // start their wait clock here
+    tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+    if (tctx && !tctx->runnable_at)
+        tctx->runnable_at = bpf_ktime_get_ns();
     
-    stat_ptr = bpf_map_lookup_elem(&queue_stats, &key);
-    if (stat_ptr) {
-        __sync_fetch_and_add(stat_ptr, 1);
-    }
+    // Look up the task's level
+    level = task_level(p);
+    is_priority = LEVEL_IS_PRIORITY(level);
+    key = is_priority ? STAT_PRIORITY_ENQUEUED : STAT_BATCH_ENQUEUED;
+    stat_inc(key);
     
-    // Dispatch all tasks to local CPU queue
-    scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, enq_flags);
+    // Queue the task on its level DSQ in the LLC of the CPU it last ran
+    // on, where its cache is warm; dispatch() decides the order
+    llc = cpu_llc(scx_bpf_task_cpu(p));
+
+    // A task dequeued before it ran is still counted where it was
+    if (tctx) {
+        level_unqueue(tctx);
+        tctx->queued_llc = llc;
+        tctx->queued_level = level;
+        tctx->queued = true;
+    }
+    level_account(llc, level, true);
+    trace_event(SCHED_EV_ENQUEUE, p, level, LEVEL_DSQ(llc, level), llc, -1);
+
+    if (is_priority) {
+        scx_bpf_dispatch(p, LEVEL_DSQ(llc, level), task_slice(true, llc), enq_flags);
+
+        // No idle CPU was found for it, so make room by preempting batch
+        // work rather than waiting for a full batch slice to expire
+        preempt_batch_cpu(p, llc);
+        return;
+    }
+
+    // Sleepers may bank at most one batch slice of vtime credit, so a
+    // task that slept for a long time cannot monopolize the batch class
+    read_config(&cfg);
+    vtime = p->scx.dsq_vtime;
+    if (vtime_before(vtime, vtime_now - cfg.batch_slice_ns))
+        vtime = vtime_now - cfg.batch_slice_ns;
+
+    scx_bpf_dispatch_vtime(p, LEVEL_DSQ(llc, level), task_slice(false, llc), vtime, enq_flags);
+}
+
+// Runnable hook - the task starts waiting for a CPU
+void BPF_STRUCT_OPS(runnable, struct task_struct *p, u64 enq_flags)
+{
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+
+    if (tctx)
+        tctx->runnable_at = bpf_ktime_get_ns();
+}
+
+// Running hook - the task has left its level DSQ. Advance the batch vtime,
+// end this CPU's idle period and record how long the task waited, split
+// by class. The dispatch event for a consumed task is recorded here, as
+// scx_bpf_consume() does not say which task it moved.
+void BPF_STRUCT_OPS(running, struct task_struct *p)
+{
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+    struct cpu_stats *cs;
+    struct cpu_ctx *cctx;
+    __u32 zero = 0, key, bucket;
+    __u64 now = bpf_ktime_get_ns();
+    __u64 delta;
+
+    if (!tctx)
+        return;
+
+    if (tctx->queued) {
+        level_unqueue(tctx);
+        trace_event(SCHED_EV_DISPATCH, p, tctx->queued_level,
+                    LEVEL_DSQ(tctx->queued_llc, tctx->queued_level), tctx->queued_llc, -1);
+    }
+
+    tctx->running_at = now;
+    if (!tctx->is_priority && vtime_before(vtime_now, p->scx.dsq_vtime))
+        vtime_now = p->scx.dsq_vtime;
+
+    // Advertise this CPU as preemptible while it runs batch work
+    cctx = bpf_map_lookup_elem(&cpu_ctx_map, &zero);
+    if (cctx) {
+        set_batch_cpu(cctx, !tctx->is_priority);
+        if (cctx->idle_since) {
+            stat_add(STAT_IDLE_NS, now - cctx->idle_since);
+            cctx->idle_since = 0;
+        }
+    }
+
+    if (!tctx->runnable_at)
+        return;
+
+    delta = now - tctx->runnable_at;
+    tctx->runnable_at = 0;
+
+    cs = this_cpu_stats();
+    if (!cs)
+        return;
+
+    key = tctx->is_priority ? LAT_CLASS_PRIORITY : LAT_CLASS_BATCH;
+    bucket = log2_u64(delta);
+    if (bucket < NR_LAT_BUCKETS)
+        cs->lat[key].buckets[bucket]++;
+}
+
+// Stopping hook - the task leaves the CPU. Batch tasks are charged the
+// time they ran, scaled inversely by their weight (100 for nice 0).
+void BPF_STRUCT_OPS(stopping, struct task_struct *p, bool runnable)
+{
+    __u32 zero = 0;
+    struct cpu_ctx *cctx = bpf_map_lookup_elem(&cpu_ctx_map, &zero);
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+
+    if (cctx)
+        set_batch_cpu(cctx, false);
+
+    if (tctx && !tctx->is_priority && tctx->running_at && p->scx.weight)
+        p->scx.dsq_vtime += (bpf_ktime_get_ns() - tctx->running_at) * 100 / p->scx.weight;
+}
+
+// Enable hook - new batch tasks start at the current vtime
+void BPF_STRUCT_OPS(enable, struct task_struct *p)
+{
+    p->scx.dsq_vtime = vtime_now;
+}
+
+// Disable hook - the task leaves sched_ext, e.g. for SCHED_FIFO, and is
+// taken off its DSQ without running, so uncount it here
+void BPF_STRUCT_OPS(disable, struct task_struct *p)
+{
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
+
+    if (tctx)
+        level_unqueue(tctx);
+}
+
+// Consume one task from the LLC's most urgent batch level and reset its
+// starvation guard
+static bool consume_batch(__u32 llc, struct cpu_ctx *cctx, __u64 now)
+{
+    bool found = consume_levels(llc, LEVEL_DEFAULT, NR_LEVELS);
+
+    // Empty batch levels are not starving, so restart their wait clock too
+    if (llc < MAX_LLCS)
+        last_batch_dispatch_ns[llc] = now;
+    if (found) {
+        stat_inc(STAT_BATCH_DISPATCHED);
+        if (cctx)
+            cctx->priority_streak = 0;
+    }
+    return found;
+}
+
+// Steal one task from the remote LLC with the most urgent ready level,
+// preferring the longer queue on a tie. Priority work only crosses NUMA
+// nodes once its level's queue is past the configured imbalance.
+static bool steal_remote(__u32 local_llc, __u32 numa_imbalance)
+{
+    __u32 best_level = NR_LEVELS, best_nr = 0, best_llc = 0;
+    __u32 local_node = local_llc < MAX_LLCS ? llc_node[local_llc] : 0;
+
+    for (__u32 llc = 0; llc < MAX_LLCS && llc < nr_llcs; llc++) {
+        __u32 level, nr;
+
+        if (llc == local_llc)
+            continue;
+
+        level = first_ready_level(llc, 0);
+        if (LEVEL_IS_PRIORITY(level) && llc_node[llc] != local_node &&
+            level_queued(llc, level) < numa_imbalance)
+            level = first_ready_level(llc, LEVEL_DEFAULT);
+        if (level >= NR_LEVELS)
+            continue;
+
+        nr = level_queued(llc, level);
+        if (level < best_level || (level == best_level && nr > best_nr)) {
+            best_level = level;
+            best_nr = nr;
+            best_llc = llc;
+        }
+    }
+
+    if (best_level < NR_LEVELS && scx_bpf_consume(LEVEL_DSQ(best_llc, best_level))) {
+        stat_inc(LEVEL_IS_PRIORITY(best_level) ? STAT_PRIORITY_DISPATCHED :
+                                                 STAT_BATCH_DISPATCHED);
+        stat_inc(STAT_LLC_STOLEN);
+        return true;
+    }
+    return false;
 }
 
 // Dispatch hook - decides which task to run
-void dispatch(s32 cpu, struct task_struct *prev)
+void BPF_STRUCT_OPS(dispatch, s32 cpu, struct task_struct *prev)
 {
-    // In this simple implementation, we let the kernel's default scheduling handle dispatch
-    // The priority is managed through the enqueue hook which places tasks on local queues
-    if (!scx_bpf_consume(SCX_DSQ_GLOBAL)) {
-        // No global tasks, let the CPU go idle
+    __u32 zero = 0;
+    struct sched_config cfg;
+    struct cpu_ctx *cctx;
+    __u64 now = bpf_ktime_get_ns();
+    __u32 llc = cpu_llc(cpu);
+    bool batch_due = false;
+
+    read_config(&cfg);
+
+    // Starvation guard: let one batch task through after too many
+    // consecutive priority dispatches or after the batch levels have
+    // waited too long
+    cctx = bpf_map_lookup_elem(&cpu_ctx_map, &zero);
+    if (cctx && cctx->priority_streak >= cfg.batch_ratio)
+        batch_due = true;
+    if (llc < MAX_LLCS && now - last_batch_dispatch_ns[llc] >= cfg.max_batch_wait_ns)
+        batch_due = true;
+
+    if (batch_due && consume_batch(llc, cctx, now))
+        return;
+
+    // Priority levels go first otherwise, most urgent first
+    if (consume_levels(llc, 0, LEVEL_DEFAULT)) {
+        stat_inc(STAT_PRIORITY_DISPATCHED);
+        if (cctx)
+            cctx->priority_streak++;
         return;
     }
+
+    // Fall back to batch work when no priority level has work
+    if (consume_batch(llc, cctx, now))
+        return;
+
+    // Only cross the LLC boundary when this LLC has nothing queued
+    if (steal_remote(llc, cfg.numa_imbalance))
+        return;
+
+    // Nothing to run: unless prev keeps its slot, the CPU goes idle until
+    // running() is next called here
+    if (cctx && !cctx->idle_since && !(prev && (prev->scx.flags & SCX_TASK_QUEUED)))
+        cctx->idle_since = now;
 }
 
 // Exit task hook - cleanup when task exits
-void exit_task(struct task_struct *p, struct scx_exit_task_args *args)
+void BPF_STRUCT_OPS(exit_task, struct task_struct *p, struct scx_exit_task_args *args)
 {
+    struct task_ctx *tctx = bpf_task_storage_get(&task_ctx_stor, p, 0, 0);
     __u32 pid = p->pid;
+
+    if (tctx) {
+        level_unqueue(tctx);
+        trace_event(SCHED_EV_EXIT, p, tctx->level, SCX_DSQ_INVALID, 0, -1);
+    }
     bpf_map_delete_elem(&priority_pids_map, &pid);
 }
 
+// Exit hook - record why the scheduler is being unloaded
+void BPF_STRUCT_OPS(scheduler_exit, struct scx_exit_info *ei)
+{
+    __u32 zero = 0;
+    struct exit_record *rec;
+
+    rec = bpf_map_lookup_elem(&exit_info_map, &zero);
+    if (!rec)
+        return;
+
+    bpf_probe_read_kernel_str(rec->reason, sizeof(rec->reason), ei->reason);
+    bpf_probe_read_kernel_str(rec->msg, sizeof(rec->msg), ei->msg);
+    rec->exit_code = ei->exit_code;
+    // Written last so the loader never sees a half-filled record
+    rec->kind = ei->kind;
+}
+
 // Structure defining the scheduler operations
-SEC("struct_ops/sched_ext")
+SEC(".struct_ops.link")
 struct sched_ext_ops scheduler_ops = {
-    .enqueue = enqueue,
-    .dispatch = dispatch,
-    .exit_task = exit_task,
+    .init = (void *)init,
+    .select_cpu = (void *)select_cpu,
+    .init_task = (void *)init_task,
+    .enqueue = (void *)enqueue,
+    .dispatch = (void *)dispatch,
+    .runnable = (void *)runnable,
+    .running = (void *)running,
+    .stopping = (void *)stopping,
+    .enable = (void *)enable,
+    .disable = (void *)disable,
+    .cgroup_init = (void *)cgroup_init,
+    .cgroup_exit = (void *)cgroup_exit,
+    .cgroup_move = (void *)cgroup_move,
+    .exit_task = (void *)exit_task,
+    .exit = (void *)scheduler_exit,
     .name = "priority_scheduler",
 };
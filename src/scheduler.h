@@ -0,0 +1,136 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+// Definitions shared between scheduler.bpf.c and loader.c.
+// The BPF side gets the __u32/__u64 types from vmlinux.h,
+// user space from <linux/types.h>.
+
+// Priority levels, 0-255. Lower levels run first. Levels below
+// LEVEL_DEFAULT form the priority class; LEVEL_DEFAULT, where unclassified
+// tasks live, and everything after it form the vtime-ordered batch class.
+#define NR_LEVELS           256
+#define LEVEL_RT            0
+#define LEVEL_INTERACTIVE   1       // what plain "loader -a" assigns
+#define LEVEL_DEFAULT       128
+#define LEVEL_BATCH         192
+#define LEVEL_IDLE          255
+#define LEVEL_IS_PRIORITY(level) ((level) < LEVEL_DEFAULT)
+
+// priority_pids_map values: the level in the low bits plus flags
+#define PRIO_LEVEL_MASK     0xff
+#define PRIO_FLAG_INHERIT   (1U << 31)  // processes forked by it inherit the entry
+
+// sched_stats counter indices. The first eight fill the first cache line
+// and are the ones every enqueue and dispatch touches; the rest are
+// rarely updated and live on the second line.
+#define STAT_PRIORITY_ENQUEUED   0
+#define STAT_BATCH_ENQUEUED      1
+#define STAT_PRIORITY_DISPATCHED 2
+#define STAT_BATCH_DISPATCHED    3
+#define STAT_DIRECT_DISPATCHED   4
+#define STAT_BATCH_PREEMPTED     5
+// Gauges: +1 when a task is queued on a level DSQ, -1 when it leaves,
+// on whichever CPU that happens, so only the sum over CPUs is meaningful
+#define STAT_PRIORITY_QUEUED     6
+#define STAT_BATCH_QUEUED        7
+#define NR_HOT_STATS             8
+#define STAT_LLC_STOLEN          8
+#define STAT_IDLE_NS             9  // time CPUs sat idle after dispatch() found nothing
+#define STAT_TRACE_DROPPED       10 // sampled events lost to a full ring buffer
+#define NR_STATS                 11
+
+// Every counter of one CPU in one cache-aligned block. The hot path
+// only touches the first line; see NR_HOT_STATS.
+struct sched_stats {
+    __u64 counters[NR_STATS];
+} __attribute__((aligned(64)));
+
+_Static_assert(NR_HOT_STATS * sizeof(__u64) <= 64, "hot stats must share one cache line");
+
+// Where "loader --daemon" pins the maps that control commands and
+// stats readers open
+#define PIN_DIR "/sys/fs/bpf/priority_scheduler"
+
+// Topology limits. cpu_llc_map holds one dense LLC index per CPU and
+// cpu_node_map its NUMA node.
+#define MAX_CPUS  1024
+#define MAX_LLCS  64
+#define MAX_NODES 64
+
+// Latency histogram classes and buckets. Bucket i counts enqueue-to-run
+// delays in [2^i, 2^(i+1)) ns; bucket 0 also takes zero.
+#define LAT_CLASS_PRIORITY 0
+#define LAT_CLASS_BATCH    1
+#define NR_LAT_CLASSES     2
+#define NR_LAT_BUCKETS     64
+
+struct lat_hist {
+    __u64 buckets[NR_LAT_BUCKETS];
+};
+
+// queue_stats value: one CPU's counters and enqueue-to-run histograms.
+// queue_stats is a BPF_F_MMAPABLE array of MAX_CPUS of these indexed by
+// CPU, so readers can mmap it and sample with plain loads. The size is a
+// multiple of 64, which makes it the element stride and keeps every
+// CPU's stripe on cache lines of its own.
+struct cpu_stats {
+    struct sched_stats stats;
+    struct lat_hist lat[NR_LAT_CLASSES];
+} __attribute__((aligned(64)));
+
+// Defaults, used when a sched_config field is zero
+#define DEFAULT_BATCH_RATIO              8
+#define DEFAULT_NUMA_IMBALANCE           4
+#define DEFAULT_MAX_BATCH_WAIT_NS        (50ULL * 1000 * 1000)
+#define DEFAULT_PRIORITY_SLICE_NS        (1ULL * 1000 * 1000)
+#define DEFAULT_BATCH_SLICE_NS           (20ULL * 1000 * 1000)
+#define DEFAULT_BATCH_STRETCH_SLICE_NS   (80ULL * 1000 * 1000)
+
+// Event tracing. The scheduler writes sampled sched_event records to the
+// "events" ring buffer while trace_ctl.sample_rate is non-zero; trace_ctl
+// lives in its own .data.trace_ctl section so the check is a plain load.
+#define SCHED_EV_ENQUEUE  1     // queued on a level DSQ
+#define SCHED_EV_DISPATCH 2     // left its DSQ for a CPU, or went straight to one
+#define SCHED_EV_EXIT     3     // exit_task()
+
+#define EVENTS_RINGBUF_SIZE (4 << 20)
+
+struct trace_ctl {
+    __u32 sample_rate;          // 0: off, N: record about 1 in N events
+};
+
+struct sched_event {
+    __u64 ts;                   // bpf_ktime_get_ns()
+    __u64 dsq;                  // DSQ entered or left, SCX_DSQ_INVALID if none
+    __u32 pid;
+    __u32 depth;                // tasks queued at that LLC and level afterwards
+    __u16 cpu;                  // for a dispatch, the CPU the task was sent to
+    __u8 type;                  // SCHED_EV_*
+    __u8 level;                 // class is LEVEL_IS_PRIORITY(level)
+    __u32 __pad;
+};
+
+// Runtime tunables, stored in the single-entry sched_config_map
+struct sched_config {
+    __u32 batch_ratio;          // priority dispatches allowed per batch dispatch
+    __u32 numa_imbalance;       // queued priority tasks before work leaves its node
+    __u64 max_batch_wait_ns;    // longest a waiting batch queue may go unserved
+    __u64 priority_slice_ns;    // time slice for priority tasks
+    __u64 batch_slice_ns;       // time slice for batch tasks
+    __u64 batch_stretch_slice_ns; // batch slice while no priority task is queued
+};
+
+// sched_ext exit information, stored in the single-entry exit_info_map.
+// kind is zero until the scheduler has been unloaded.
+#define EXIT_REASON_LEN 128
+#define EXIT_MSG_LEN    1024
+
+struct exit_record {
+    __s32 kind;                 // enum scx_exit_kind
+    __u32 __pad;
+    __s64 exit_code;
+    char reason[EXIT_REASON_LEN];
+    char msg[EXIT_MSG_LEN];
+};
+
+#endif /* __SCHEDULER_H */
@@ -0,0 +1,78 @@
+#ifndef __STATS_MMAP_H
+#define __STATS_MMAP_H
+
+// Syscall-free access to the scheduler's statistics, for the loader and
+// for monitoring agents. Map the daemon's pinned queue_stats once, then
+// sample it with plain loads as often as needed.
+// Include after <linux/types.h> and scheduler.h.
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <bpf/bpf.h>
+
+#define STATS_PIN_PATH PIN_DIR "/queue_stats"
+
+#define STATS_MMAP_SIZE (MAX_CPUS * sizeof(struct cpu_stats))
+
+// Map a queue_stats fd read-only, one stripe per CPU. Returns NULL with
+// errno set on failure. The mapping stays valid after the fd is closed.
+static inline const volatile struct cpu_stats *stats_mmap(int stats_fd)
+{
+    void *p = mmap(NULL, STATS_MMAP_SIZE, PROT_READ, MAP_SHARED, stats_fd, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Map the running scheduler's queue_stats
+static inline const volatile struct cpu_stats *stats_mmap_pinned(void)
+{
+    const volatile struct cpu_stats *stats;
+    int fd = bpf_obj_get(STATS_PIN_PATH);
+    int err;
+
+    if (fd < 0)
+        return NULL;
+    stats = stats_mmap(fd);
+    err = errno;
+    close(fd);
+    errno = err;
+    return stats;
+}
+
+static inline void stats_munmap(const volatile struct cpu_stats *stats)
+{
+    munmap((void *)stats, STATS_MMAP_SIZE);
+}
+
+// Copy one CPU's stripe. Every counter is read with a single 64-bit load,
+// but the copy is not a snapshot: other counters keep moving meanwhile.
+static inline void stats_read_cpu(const volatile struct cpu_stats *stats, int cpu,
+                                  struct cpu_stats *out)
+{
+    const volatile __u64 *src = (const volatile __u64 *)&stats[cpu];
+    __u64 *dst = (__u64 *)out;
+
+    for (size_t i = 0; i < sizeof(*out) / sizeof(__u64); i++)
+        dst[i] = src[i];
+}
+
+// Sum the stripes of CPUs [0, nr_cpus) into *sum
+static inline void stats_sum(const volatile struct cpu_stats *stats, int nr_cpus,
+                             struct cpu_stats *sum)
+{
+    __u64 *dst = (__u64 *)sum;
+
+    if (nr_cpus > MAX_CPUS)
+        nr_cpus = MAX_CPUS;
+    for (size_t i = 0; i < sizeof(*sum) / sizeof(__u64); i++)
+        dst[i] = 0;
+    for (int cpu = 0; cpu < nr_cpus; cpu++) {
+        const volatile __u64 *src = (const volatile __u64 *)&stats[cpu];
+
+        for (size_t i = 0; i < sizeof(*sum) / sizeof(__u64); i++)
+            dst[i] += src[i];
+    }
+}
+
+#endif /* __STATS_MMAP_H */
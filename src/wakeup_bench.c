@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// schbench-style wakeup latency benchmark. Each message thread wakes its
+// workers, waits for all of them to finish a short burst of CPU work, then
+// sleeps and starts the next round. Workers record the time from the
+// futex wake to actually running on a CPU, which is the scheduler's
+// wakeup latency, in a log-linear (HDR style) histogram.
+
+// Histogram values are in ns. Values below 128 get their own bucket;
+// above that each power of two is split into 64 buckets, so every
+// bucket is within 1.6% of the values it holds.
+#define HIST_SUB_BITS    6
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS     ((64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS + 2 * HIST_SUB_BUCKETS)
+
+struct hist {
+    unsigned long long buckets[HIST_BUCKETS];
+    unsigned long long count;
+    unsigned long long max;
+};
+
+struct worker {
+    pthread_t tid;
+    struct message *msg;
+    int futex;                  // 1 once the message thread has posted a wakeup
+    unsigned long long wake_ns; // when it did
+    struct hist hist;
+} __attribute__((aligned(64)));
+
+struct message {
+    pthread_t tid;
+    struct worker *workers;
+    int pending;                // workers still running this round
+    int done_futex;
+} __attribute__((aligned(64)));
+
+static int nr_message = 2, nr_workers = 4;
+static int runtime_s = 10, warmup_s = 2;
+static int cputime_us = 50, sleep_us = 1000;
+static volatile int stop;
+static unsigned long long warmup_end_ns;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void futex_wait(int *uaddr, int val)
+{
+    syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *uaddr)
+{
+    syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static int hist_index(unsigned long long v)
+{
+    int shift;
+
+    if (v < 2 * HIST_SUB_BUCKETS)
+        return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB_BUCKETS + (v >> shift);
+}
+
+// Highest value that lands in bucket idx
+static unsigned long long hist_value(int idx)
+{
+    int shift;
+
+    if (idx < 2 * HIST_SUB_BUCKETS)
+        return idx;
+    shift = idx / HIST_SUB_BUCKETS - 1;
+    return ((unsigned long long)(idx % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+static void hist_add(struct hist *h, unsigned long long v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static unsigned long long hist_percentile(const struct hist *h, double pct)
+{
+    unsigned long long target = h->count * pct / 100.0, seen = 0;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+// Burn CPU for the configured time, standing in for request processing
+static void spin(void)
+{
+    unsigned long long end = now_ns() + cputime_us * 1000ULL;
+
+    while (now_ns() < end)
+        ;
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+    struct message *msg = w->msg;
+
+    while (!stop) {
+        unsigned long long now;
+
+        while (!__atomic_load_n(&w->futex, __ATOMIC_ACQUIRE) && !stop)
+            futex_wait(&w->futex, 0);
+        if (stop)
+            break;
+
+        now = now_ns();
+        __atomic_store_n(&w->futex, 0, __ATOMIC_RELAXED);
+        if (now >= warmup_end_ns)
+            hist_add(&w->hist, now - w->wake_ns);
+
+        spin();
+
+        if (__atomic_sub_fetch(&msg->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            __atomic_store_n(&msg->done_futex, 1, __ATOMIC_RELEASE);
+            futex_wake(&msg->done_futex);
+        }
+    }
+    return NULL;
+}
+
+static void *message_fn(void *arg)
+{
+    struct message *msg = arg;
+
+    while (!stop) {
+        __atomic_store_n(&msg->pending, nr_workers, __ATOMIC_RELAXED);
+        __atomic_store_n(&msg->done_futex, 0, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < nr_workers; i++) {
+            struct worker *w = &msg->workers[i];
+
+            w->wake_ns = now_ns();
+            __atomic_store_n(&w->futex, 1, __ATOMIC_RELEASE);
+            futex_wake(&w->futex);
+        }
+
+        while (!__atomic_load_n(&msg->done_futex, __ATOMIC_ACQUIRE) && !stop)
+            futex_wait(&msg->done_futex, 0);
+
+        usleep(sleep_us);
+    }
+    return NULL;
+}
+
+static void print_usage(const char *prog)
+{
+    printf("Usage: %s [OPTIONS]\n", prog);
+    printf("Options:\n");
+    printf("  -m, --message-threads <n> Message threads (default %d)\n", nr_message);
+    printf("  -t, --workers <n>         Workers per message thread (default %d)\n", nr_workers);
+    printf("  -r, --runtime <s>         Measured run time in seconds (default %d)\n", runtime_s);
+    printf("  -w, --warmup <s>          Seconds before samples are recorded (default %d)\n", warmup_s);
+    printf("  -c, --cputime <us>        CPU work per wakeup in microseconds (default %d)\n", cputime_us);
+    printf("  -s, --sleep <us>          Message thread sleep between rounds (default %d)\n", sleep_us);
+    printf("  -h, --help                Show this help message\n");
+}
+
+static int parse_positive(const char *arg, const char *what, int allow_zero)
+{
+    char *end;
+    long v = strtol(arg, &end, 10);
+
+    if (end == arg || *end || v < !allow_zero || v > INT_MAX) {
+        fprintf(stderr, "Error: invalid %s: %s\n", what, arg);
+        exit(1);
+    }
+    return v;
+}
+
+int main(int argc, char **argv)
+{
+    struct option options[] = {
+        {"message-threads", required_argument, NULL, 'm'},
+        {"workers", required_argument, NULL, 't'},
+        {"runtime", required_argument, NULL, 'r'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"cputime", required_argument, NULL, 'c'},
+        {"sleep", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, NULL, 0}
+    };
+    struct message *msgs;
+    struct hist *total;
+    unsigned long long start_ns, elapsed_ns;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "m:t:r:w:c:s:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            nr_message = parse_positive(optarg, "message thread count", 0);
+            break;
+        case 't':
+            nr_workers = parse_positive(optarg, "worker count", 0);
+            break;
+        case 'r':
+            runtime_s = parse_positive(optarg, "runtime", 0);
+            break;
+        case 'w':
+            warmup_s = parse_positive(optarg, "warmup", 1);
+            break;
+        case 'c':
+            cputime_us = parse_positive(optarg, "cputime", 1);
+            break;
+        case 's':
+            sleep_us = parse_positive(optarg, "sleep", 1);
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    msgs = calloc(nr_message, sizeof(*msgs));
+    total = calloc(1, sizeof(*total));
+    if (!msgs || !total) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    start_ns = now_ns();
+    warmup_end_ns = start_ns + warmup_s * 1000000000ULL;
+
+    for (int m = 0; m < nr_message; m++) {
+        struct message *msg = &msgs[m];
+
+        if (posix_memalign((void **)&msg->workers, 64, nr_workers * sizeof(*msg->workers))) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        memset(msg->workers, 0, nr_workers * sizeof(*msg->workers));
+
+        for (int i = 0; i < nr_workers; i++) {
+            msg->workers[i].msg = msg;
+            if (pthread_create(&msg->workers[i].tid, NULL, worker_fn, &msg->workers[i])) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+        if (pthread_create(&msg->tid, NULL, message_fn, msg)) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    sleep(warmup_s + runtime_s);
+    stop = 1;
+
+    // Release everyone still parked on a futex
+    for (int m = 0; m < nr_message; m++) {
+        struct message *msg = &msgs[m];
+
+        __atomic_store_n(&msg->done_futex, 1, __ATOMIC_RELEASE);
+        futex_wake(&msg->done_futex);
+        for (int i = 0; i < nr_workers; i++) {
+            __atomic_store_n(&msg->workers[i].futex, 1, __ATOMIC_RELEASE);
+            futex_wake(&msg->workers[i].futex);
+        }
+    }
+
+    for (int m = 0; m < nr_message; m++) {
+        pthread_join(msgs[m].tid, NULL);
+        for (int i = 0; i < nr_workers; i++) {
+            pthread_join(msgs[m].workers[i].tid, NULL);
+            hist_merge(total, &msgs[m].workers[i].hist);
+        }
+        free(msgs[m].workers);
+    }
+    elapsed_ns = now_ns() - warmup_end_ns;
+
+    printf("Wakeup latency (us), %d message threads x %d workers, %llu samples:\n",
+           nr_message, nr_workers, total->count);
+    printf("  p50:   %.1f\n", hist_percentile(total, 50) / 1000.0);
+    printf("  p90:   %.1f\n", hist_percentile(total, 90) / 1000.0);
+    printf("  p99:   %.1f\n", hist_percentile(total, 99) / 1000.0);
+    printf("  p99.9: %.1f\n", hist_percentile(total, 99.9) / 1000.0);
+    printf("  max:   %.1f\n", total->max / 1000.0);
+    printf("Wakeups/sec: %.0f\n", total->count * 1e9 / elapsed_ns);
+
+    // One line for scripts to parse
+    printf("summary: samples=%llu p50_us=%.1f p90_us=%.1f p99_us=%.1f p999_us=%.1f "
+           "max_us=%.1f wakeups_per_sec=%.0f\n",
+           total->count,
+           hist_percentile(total, 50) / 1000.0,
+           hist_percentile(total, 90) / 1000.0,
+           hist_percentile(total, 99) / 1000.0,
+           hist_percentile(total, 99.9) / 1000.0,
+           total->max / 1000.0,
+           total->count * 1e9 / elapsed_ns);
+
+    free(msgs);
+    free(total);
+    return 0;
+}